@@ -0,0 +1,344 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <chrono>
+#include "BVH.h"
+#include "Parallel.h"
+
+namespace {
+    // nodes with fewer primitives are binned and split on one thread, and their subtrees are not spawned
+    const int parallelThreshold = 1 << 14;
+
+    int bin_index(const float c, const float min, const float scale) {
+        return std::min(BVH::binCount - 1, static_cast<int>((c - min) * scale));
+    }
+
+    struct CentroidLess {
+        const std::vector<Vec3f> &centroids;
+        int axis;
+
+        bool operator()(const int a, const int b) const {
+            if (centroids[a][axis] != centroids[b][axis])
+                return centroids[a][axis] < centroids[b][axis];
+            return a < b;
+        }
+    };
+}
+
+void BVH::build(const std::vector<AABB> &primBounds, const BVHOptions &options, const PrimSplitter &splitter) {
+    auto start = std::chrono::steady_clock::now();
+    const int n = static_cast<int>(primBounds.size());
+    nodes.clear();
+    leafWidth = std::max(1, options.leafWidth);
+    primIndices.resize(n);
+    if (!n)
+        return;
+
+    std::vector<Vec3f> centroids(n);
+    parallel_for(0, n, [&](const int i) {
+        primIndices[i] = i;
+        centroids[i] = primBounds[i].centroid();
+    });
+
+    const BVHBuilder builder = options.builder;
+    if (builder == BVHBuilder::SweepSAH) {
+        nodes.reserve(2 * n - 1);
+        nodes.emplace_back();
+        buildSweep(0, 0, n, 0, primBounds, centroids);
+    } else if (builder == BVHBuilder::Linear) {
+        buildLinear(primBounds, centroids);
+    } else if (builder == BVHBuilder::SpatialSAH) {
+        buildSpatial(primBounds, splitter, splitter ? options.splitBudget : 0);
+    } else {
+        // node pairs are handed out by an atomic counter, so the layout matches the sequential builders
+        nodes.resize(2 * n - 1);
+        std::atomic<int> nodeCount(1);
+        ThreadPool::instance().reserve(worker_count() - 1);
+        int spawnDepth = 0;
+        while ((1 << spawnDepth) < 2 * worker_count())
+            ++spawnDepth;
+        buildBinned(0, 0, n, 0, spawnDepth, worker_count(), nodeCount, primBounds, centroids);
+        nodes.resize(nodeCount);
+    }
+
+    levelOrder.clear();
+    levelStarts.clear();
+    builtCost = sahCost();
+    buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void BVH::assign(const BVHNode *treeNodes, const size_t nodeCount, const int *refs, const size_t refCount,
+                 const int width) {
+    leafWidth = std::max(1, width);
+    nodes.assign(treeNodes, treeNodes + nodeCount);
+    primIndices.assign(refs, refs + refCount);
+    levelOrder.clear();
+    levelStarts.clear();
+    builtCost = sahCost();
+    buildTime = 0;
+}
+
+void BVH::refit(const std::vector<AABB> &primBounds) {
+    if (nodes.empty())
+        return;
+
+    if (levelOrder.empty()) {
+        levelOrder.reserve(nodes.size());
+        levelOrder.push_back(0);
+        for (size_t begin = 0; begin < levelOrder.size();) {
+            levelStarts.push_back(static_cast<int>(begin));
+            size_t end = levelOrder.size();
+            for (size_t i = begin; i < end; ++i) {
+                const BVHNode &node = nodes[levelOrder[i]];
+                if (!node.isLeaf()) {
+                    levelOrder.push_back(node.leftFirst);
+                    levelOrder.push_back(node.leftFirst + 1);
+                }
+            }
+            begin = end;
+        }
+        levelStarts.push_back(static_cast<int>(levelOrder.size()));
+    }
+
+    // every node of a level depends only on the level below it, so a whole level is refit concurrently
+    for (int level = static_cast<int>(levelStarts.size()) - 2; level >= 0; --level) {
+        parallel_for(levelStarts[level], levelStarts[level + 1], [&](const int i) {
+            BVHNode &node = nodes[levelOrder[i]];
+            node.bounds = AABB();
+            if (node.isLeaf()) {
+                for (int p = node.leftFirst; p < node.leftFirst + node.count; ++p)
+                    node.bounds.grow(primBounds[primIndices[p]]);
+            } else {
+                node.bounds.grow(nodes[node.leftFirst].bounds);
+                node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+            }
+        });
+    }
+}
+
+// splits the node where the surface area heuristic is minimal, trying every possible split position on every axis
+void BVH::buildSweep(const int nodeIdx, const int first, const int count, const int depth,
+                     const std::vector<AABB> &primBounds, const std::vector<Vec3f> &centroids) {
+    AABB bounds;
+    for (int i = first; i < first + count; ++i)
+        bounds.grow(primBounds[primIndices[i]]);
+    nodes[nodeIdx].bounds = bounds;
+    nodes[nodeIdx].leftFirst = first;
+    nodes[nodeIdx].count = count;
+    if (count == 1 || depth >= maxDepth - 1)
+        return;
+
+    const float nodeArea = bounds.area() > 0 ? bounds.area() : 1;
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1, bestSplit = 0;
+
+    std::vector<int> sorted(primIndices.begin() + first, primIndices.begin() + first + count);
+    std::vector<float> rightArea(count);
+    for (int axis = 0; axis < 3; ++axis) {
+        CentroidLess less = {centroids, axis};
+        std::sort(sorted.begin(), sorted.end(), less);
+
+        AABB right;
+        for (int i = count - 1; i > 0; --i) {
+            right.grow(primBounds[sorted[i]]);
+            rightArea[i] = right.area();
+        }
+
+        AABB left;
+        for (int i = 0; i < count - 1; ++i) {
+            left.grow(primBounds[sorted[i]]);
+            float cost = traversalCost + (left.area() * leafCost(i + 1) + rightArea[i + 1] * leafCost(count - i - 1)) /
+                                         nodeArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i + 1;
+            }
+        }
+    }
+
+    if (bestAxis < 0 || (bestCost >= leafCost(count) && count <= leafLimit()))
+        return;
+
+    CentroidLess less = {centroids, bestAxis};
+    std::sort(primIndices.begin() + first, primIndices.begin() + first + count, less);
+
+    const int left = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[nodeIdx].leftFirst = left;
+    nodes[nodeIdx].count = 0;
+    buildSweep(left, first, bestSplit, depth + 1, primBounds, centroids);
+    buildSweep(left + 1, first + bestSplit, count - bestSplit, depth + 1, primBounds, centroids);
+}
+
+// splits the node at the cheapest of binCount - 1 planes per axis, big nodes are binned by up to threads threads
+// and the two subtrees of a big node are built concurrently while spawnDepth lasts, each with half the threads,
+// so all subtrees running at once bin with about as many threads as there are workers
+void BVH::buildBinned(const int nodeIdx, const int first, const int count, const int depth, const int spawnDepth,
+                      const int threads, std::atomic<int> &nodeCount,
+                      const std::vector<AABB> &primBounds, const std::vector<Vec3f> &centroids) {
+    const int chunks = count < parallelThreshold ? 1 : std::min(threads, chunk_count(first, first + count,
+                                                                                      parallelThreshold));
+
+    std::vector<AABB> chunkBounds(chunks), chunkCentroids(chunks);
+    parallel_chunks(first, first + count, chunks, [&](const int c, const int b, const int e) {
+        for (int i = b; i < e; ++i) {
+            chunkBounds[c].grow(primBounds[primIndices[i]]);
+            chunkCentroids[c].grow(centroids[primIndices[i]]);
+        }
+    });
+    AABB bounds, centroidBounds;
+    for (int c = 0; c < chunks; ++c) {
+        bounds.grow(chunkBounds[c]);
+        centroidBounds.grow(chunkCentroids[c]);
+    }
+
+    BVHNode &node = nodes[nodeIdx];
+    node.bounds = bounds;
+    node.leftFirst = first;
+    node.count = count;
+    if (count == 1 || depth >= maxDepth - 1)
+        return;
+
+    float scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        scale[axis] = extent > 0 ? binCount / extent : 0;
+    }
+
+    std::vector<Bin> chunkBins(chunks * 3 * binCount);
+    parallel_chunks(first, first + count, chunks, [&](const int c, const int b, const int e) {
+        Bin *bins = &chunkBins[c * 3 * binCount];
+        for (int i = b; i < e; ++i) {
+            const int prim = primIndices[i];
+            for (int axis = 0; axis < 3; ++axis) {
+                Bin &bin = bins[axis * binCount + bin_index(centroids[prim][axis], centroidBounds.min[axis], scale[axis])];
+                bin.bounds.grow(primBounds[prim]);
+                ++bin.count;
+            }
+        }
+    });
+    for (int c = 1; c < chunks; ++c) {
+        for (int i = 0; i < 3 * binCount; ++i) {
+            chunkBins[i].bounds.grow(chunkBins[c * 3 * binCount + i].bounds);
+            chunkBins[i].count += chunkBins[c * 3 * binCount + i].count;
+        }
+    }
+
+    const float nodeArea = bounds.area() > 0 ? bounds.area() : 1;
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1, bestSplit = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (scale[axis] == 0)
+            continue;
+
+        const Bin *bins = &chunkBins[axis * binCount];
+        float rightArea[binCount];
+        int rightCount[binCount];
+        AABB right;
+        int rightSum = 0;
+        for (int i = binCount - 1; i > 0; --i) {
+            right.grow(bins[i].bounds);
+            rightSum += bins[i].count;
+            rightArea[i] = right.area();
+            rightCount[i] = rightSum;
+        }
+
+        AABB left;
+        int leftSum = 0;
+        for (int i = 0; i < binCount - 1; ++i) {
+            left.grow(bins[i].bounds);
+            leftSum += bins[i].count;
+            if (!leftSum || !rightCount[i + 1])
+                continue;
+            float cost = traversalCost +
+                         (left.area() * leafCost(leftSum) + rightArea[i + 1] * leafCost(rightCount[i + 1])) / nodeArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i + 1;
+            }
+        }
+    }
+
+    if (bestCost >= leafCost(count) && count <= leafLimit())
+        return;
+
+    int mid;
+    if (bestAxis < 0) {
+        // all centroids coincide, no plane separates them, so just halve the range
+        mid = first + count / 2;
+    } else {
+        mid = static_cast<int>(std::partition(primIndices.begin() + first, primIndices.begin() + first + count,
+                                              [&](const int prim) {
+                                                  return bin_index(centroids[prim][bestAxis],
+                                                                   centroidBounds.min[bestAxis],
+                                                                   scale[bestAxis]) < bestSplit;
+                                              }) - primIndices.begin());
+    }
+
+    const int left = nodeCount.fetch_add(2);
+    node.leftFirst = left;
+    node.count = 0;
+    if (spawnDepth > 0 && count >= parallelThreshold) {
+        const int half = std::max(1, threads / 2);
+        TaskGroup leftBuilder;
+        leftBuilder.run([&]() {
+            buildBinned(left, first, mid - first, depth + 1, spawnDepth - 1, half, nodeCount, primBounds, centroids);
+        });
+        buildBinned(left + 1, mid, first + count - mid, depth + 1, spawnDepth - 1, half, nodeCount, primBounds,
+                    centroids);
+        leftBuilder.wait();
+    } else {
+        buildBinned(left, first, mid - first, depth + 1, 0, threads, nodeCount, primBounds, centroids);
+        buildBinned(left + 1, mid, first + count - mid, depth + 1, 0, threads, nodeCount, primBounds, centroids);
+    }
+}
+
+bool BVH::empty() const {
+    return nodes.empty();
+}
+
+int BVH::nnodes() const {
+    return static_cast<int>(nodes.size());
+}
+
+int BVH::nrefs() const {
+    return static_cast<int>(primIndices.size());
+}
+
+const std::vector<BVHNode> &BVH::getNodes() const {
+    return nodes;
+}
+
+const std::vector<int> &BVH::getPrimIndices() const {
+    return primIndices;
+}
+
+double BVH::lastBuildTime() const {
+    return buildTime;
+}
+
+const AABB &BVH::bounds() const {
+    return nodes[0].bounds;
+}
+
+float BVH::sahCost() const {
+    if (nodes.empty() || nodes[0].bounds.area() <= 0)
+        return 0;
+
+    float cost = 0;
+    for (const auto &node : nodes) {
+        if (node.isLeaf())
+            cost += leafCost(node.count) * node.bounds.area();
+        else
+            cost += traversalCost * node.bounds.area();
+    }
+    return cost / nodes[0].bounds.area();
+}
+
+float BVH::degradation() const {
+    return builtCost > 0 ? sahCost() / builtCost : 1;
+}
@@ -0,0 +1,331 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_BVH_H
+#define SIMPLERAYTRACER_BVH_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include "geometry.h"
+
+struct AABB {
+    Vec3f min, max;
+
+    AABB() : min(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                  std::numeric_limits<float>::max()),
+             max(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(),
+                 -std::numeric_limits<float>::max()) {}
+
+    AABB(const Vec3f &mn, const Vec3f &mx) : min(mn), max(mx) {}
+
+    void grow(const Vec3f &p) {
+        for (size_t i = 3; i--;) {
+            min[i] = std::min(min[i], p[i]);
+            max[i] = std::max(max[i], p[i]);
+        }
+    }
+
+    void grow(const AABB &b) {
+        for (size_t i = 3; i--;) {
+            min[i] = std::min(min[i], b.min[i]);
+            max[i] = std::max(max[i], b.max[i]);
+        }
+    }
+
+    bool empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
+    Vec3f centroid() const { return (min + max) * .5f; }
+
+    // half of the surface area, constant factors cancel out in SAH
+    float area() const {
+        if (empty())
+            return 0;
+        Vec3f e = max - min;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+
+    // slab test, tnear is the entry distance clamped to zero
+    bool ray_intersect(const Vec3f &origin, const Vec3f &invDir, const float tmax, float &tnear) const {
+        float t0 = 0, t1 = tmax;
+        for (size_t i = 0; i < 3; ++i) {
+            float tmin = (min[i] - origin[i]) * invDir[i];
+            float tMax = (max[i] - origin[i]) * invDir[i];
+            if (tmin > tMax)
+                std::swap(tmin, tMax);
+            t0 = tmin > t0 ? tmin : t0;
+            t1 = tMax < t1 ? tMax : t1;
+            if (t0 > t1)
+                return false;
+        }
+        tnear = t0;
+        return true;
+    }
+};
+
+struct BVHNode {
+    AABB bounds;
+    int leftFirst; // index of the left child (right one is next to it) or of the first primitive in a leaf
+    int count;     // number of primitives in a leaf, 0 for inner nodes
+
+    BVHNode() : bounds(), leftFirst(0), count(0) {}
+
+    bool isLeaf() const { return count > 0; }
+};
+
+enum class BVHBuilder {
+    SweepSAH,  // tries every split position, best trees, single threaded
+    BinnedSAH, // evaluates splits at bin boundaries only and builds subtrees in parallel
+    Linear,    // sorts primitives along a morton curve, fastest to build but slower to trace, for per frame rebuilds
+    SpatialSAH // binned SAH that may also split primitives between children, for large and thin triangles
+};
+
+struct BVHOptions {
+    BVHBuilder builder;
+    bool wide;         // collapse the binary tree into eight wide nodes for tracing
+    float splitBudget; // spatial splits may add at most this many references per primitive
+    int leafWidth;     // primitives the leaf test takes at once, the simd width of its kernel, see BVH::leafCost()
+
+    BVHOptions(const BVHBuilder b = BVHBuilder::BinnedSAH, const bool w = false, const float budget = .3f,
+               const int width = 1) :
+            builder(b), wide(w), splitBudget(budget), leafWidth(width) {}
+};
+
+// position of a point of the unit cube along the z curve, bitsPerAxis is 10 or 21
+uint64_t morton_code(const Vec3f &p, int bitsPerAxis);
+
+// split(prim, axis, position, left, right) bounds the parts of a primitive on both sides of an axis aligned plane
+typedef std::function<void(int, int, float, AABB &, AABB &)> PrimSplitter;
+
+class BVH {
+    std::vector<BVHNode> nodes;
+    std::vector<int> primIndices;
+    double buildTime = 0;
+    float builtCost = 0;
+    int leafWidth = 1;
+    std::vector<int> levelOrder; // node indices sorted by depth, levelStarts[d] is where depth d begins
+    std::vector<int> levelStarts;
+
+    void buildSweep(int nodeIdx, int first, int count, int depth,
+                    const std::vector<AABB> &primBounds, const std::vector<Vec3f> &centroids);
+
+    void buildBinned(int nodeIdx, int first, int count, int depth, int spawnDepth, int threads,
+                     std::atomic<int> &nodeCount,
+                     const std::vector<AABB> &primBounds, const std::vector<Vec3f> &centroids);
+
+    void buildLinear(const std::vector<AABB> &primBounds, const std::vector<Vec3f> &centroids);
+
+    void buildSpatial(const std::vector<AABB> &primBounds, const PrimSplitter &splitter, float splitBudget);
+
+    void emitLinear(int nodeIdx, int first, int count, int depth, int spawnDepth, std::atomic<int> &nodeCount,
+                    const std::vector<uint64_t> &codes, const std::vector<AABB> &primBounds);
+
+public:
+    static const int maxDepth = 64;
+    static const int maxLeafSize = 4;
+    static const int binCount = 16;
+
+    // relative costs of one node traversal step and of one primitive test
+    static constexpr float traversalCost = 1;
+    static constexpr float intersectionCost = 1;
+
+    struct Bin {
+        AABB bounds;
+        int count;
+
+        Bin() : bounds(), count(0) {}
+    };
+
+    // a leaf is tested a block of leafWidth primitives at a time, so it costs one test per started block
+    float leafCost(const int count) const { return intersectionCost * ((count + leafWidth - 1) / leafWidth); }
+
+    // leaves are split until they fit one block, and at least down to maxLeafSize primitives
+    int leafLimit() const { return leafWidth > maxLeafSize ? leafWidth : maxLeafSize; }
+
+    // builds the tree from primitive bounds, primitives are referred to by their index,
+    // spatial splits need the splitter and the other builders ignore it
+    void build(const std::vector<AABB> &primBounds, const BVHOptions &options = BVHOptions(),
+               const PrimSplitter &splitter = PrimSplitter());
+
+    // takes a tree built earlier, e.g. loaded from a cache file, for leaves tested width primitives at a time
+    void assign(const BVHNode *treeNodes, size_t nodeCount, const int *refs, size_t refCount, int width = 1);
+
+    bool empty() const;
+
+    int nnodes() const;
+
+    // primitive references in leaves, more than the primitive count after spatial splits
+    int nrefs() const;
+
+    const std::vector<BVHNode> &getNodes() const;
+
+    const std::vector<int> &getPrimIndices() const;
+
+    // wall time of the last build in milliseconds
+    double lastBuildTime() const;
+
+    // recomputes node bounds bottom-up for moved primitives, one tree level at a time, keeping the topology,
+    // leaves with split references get the bounds of whole primitives
+    void refit(const std::vector<AABB> &primBounds);
+
+    const AABB &bounds() const;
+
+    // surface area heuristic cost of the whole tree, relative to the root area
+    float sahCost() const;
+
+    // sahCost() as a ratio to the cost right after the last build; values well above 1 mean a rebuild pays
+    float degradation() const;
+
+    // test(primIdx, tnear) must return true and shrink tnear when it finds a closer hit
+    template<typename PrimTest>
+    bool intersect(const Vec3f &origin, const Vec3f &dir, float &tnear, PrimTest test) const;
+
+    // same for whole leaves, test(first, count, tnear) gets a range of positions in getPrimIndices()
+    template<typename LeafTest>
+    bool intersectLeaves(const Vec3f &origin, const Vec3f &dir, float &tnear, LeafTest test) const;
+
+    // any hit query for shadow rays: stops at the first leaf where test(first, count) reports a hit before tmax,
+    // children are not ordered since any blocker will do
+    template<typename LeafTest>
+    bool occludedLeaves(const Vec3f &origin, const Vec3f &dir, float tmax, LeafTest test) const;
+
+    // walks the tree once for a whole RayPacket: subtrees outside its frustum are skipped with one test and
+    // every node narrows the mask of active rays, test(first, count, mask) shrinks tnear of the rays it hits
+    template<typename Packet, typename LeafTest>
+    void intersectPacket(Packet &packet, uint64_t active, LeafTest test) const;
+};
+
+template<typename PrimTest>
+bool BVH::intersect(const Vec3f &origin, const Vec3f &dir, float &tnear, PrimTest test) const {
+    return intersectLeaves(origin, dir, tnear, [&](const int first, const int count, float &t) {
+        bool found = false;
+        for (int i = first; i < first + count; ++i)
+            if (test(primIndices[i], t))
+                found = true;
+        return found;
+    });
+}
+
+template<typename LeafTest>
+bool BVH::intersectLeaves(const Vec3f &origin, const Vec3f &dir, float &tnear, LeafTest test) const {
+    if (nodes.empty())
+        return false;
+
+    Vec3f invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+    float tBox;
+    if (!nodes[0].bounds.ray_intersect(origin, invDir, tnear, tBox))
+        return false;
+
+    struct Entry {
+        int node;
+        float t;
+    } stack[maxDepth];
+    int stackSize = 0;
+    int nodeIdx = 0;
+    bool found = false;
+
+    while (true) {
+        const BVHNode &node = nodes[nodeIdx];
+        if (node.isLeaf()) {
+            if (test(node.leftFirst, node.count, tnear))
+                found = true;
+        } else {
+            int near = node.leftFirst, far = node.leftFirst + 1;
+            float tNear, tFar;
+            bool hitNear = nodes[near].bounds.ray_intersect(origin, invDir, tnear, tNear);
+            bool hitFar = nodes[far].bounds.ray_intersect(origin, invDir, tnear, tFar);
+            if (hitNear && hitFar) {
+                if (tFar < tNear) {
+                    std::swap(near, far);
+                    std::swap(tNear, tFar);
+                }
+                stack[stackSize].node = far;
+                stack[stackSize++].t = tFar;
+                nodeIdx = near;
+                continue;
+            }
+            if (hitNear || hitFar) {
+                nodeIdx = hitNear ? near : far;
+                continue;
+            }
+        }
+
+        // skip the nodes that are behind the closest hit found so far
+        while (stackSize && stack[stackSize - 1].t > tnear)
+            --stackSize;
+        if (!stackSize)
+            break;
+        nodeIdx = stack[--stackSize].node;
+    }
+    return found;
+}
+
+template<typename LeafTest>
+bool BVH::occludedLeaves(const Vec3f &origin, const Vec3f &dir, const float tmax, LeafTest test) const {
+    if (nodes.empty())
+        return false;
+
+    Vec3f invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+    int stack[maxDepth + 2];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize) {
+        const BVHNode &node = nodes[stack[--stackSize]];
+        float tBox;
+        if (!node.bounds.ray_intersect(origin, invDir, tmax, tBox))
+            continue;
+        if (node.isLeaf()) {
+            if (test(node.leftFirst, node.count))
+                return true;
+            continue;
+        }
+        stack[stackSize++] = node.leftFirst + 1;
+        stack[stackSize++] = node.leftFirst;
+    }
+    return false;
+}
+
+template<typename Packet, typename LeafTest>
+void BVH::intersectPacket(Packet &packet, uint64_t active, LeafTest test) const {
+    if (nodes.empty() || !active)
+        return;
+
+    // every node pops itself and pushes its two children
+    struct Entry {
+        int node;
+        uint64_t mask;
+    } stack[maxDepth + 2];
+    int stackSize = 0;
+    stack[stackSize].node = 0;
+    stack[stackSize++].mask = active;
+
+    while (stackSize) {
+        const Entry entry = stack[--stackSize];
+        const BVHNode &node = nodes[entry.node];
+        if (packet.frustumMisses(node.bounds))
+            continue;
+        const uint64_t mask = packet.hitMask(node.bounds, entry.mask);
+        if (!mask)
+            continue;
+
+        if (node.isLeaf()) {
+            test(node.leftFirst, node.count, mask);
+            continue;
+        }
+
+        // the child closer along the average direction goes on top
+        int near = node.leftFirst, far = node.leftFirst + 1;
+        if ((nodes[far].bounds.centroid() - nodes[near].bounds.centroid()) * packet.meanDir < 0)
+            std::swap(near, far);
+        stack[stackSize].node = far;
+        stack[stackSize++].mask = mask;
+        stack[stackSize].node = near;
+        stack[stackSize++].mask = mask;
+    }
+}
+
+#endif //SIMPLERAYTRACER_BVH_H
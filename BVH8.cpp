@@ -0,0 +1,213 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <cmath>
+#include <cstring>
+#include "BVH8.h"
+#include "Cpu.h"
+
+namespace {
+    // entry and exit distances of a child box along one axis are a + q * b for its quantized bounds q
+    void axis_factors(const BVH8Node &node, const BVH8::Ray &ray, float a[3], float b[3]) {
+        for (int axis = 0; axis < 3; ++axis) {
+            a[axis] = (node.origin[axis] - ray.origin[axis]) * ray.invDir[axis];
+            b[axis] = std::ldexp(ray.invDir[axis], node.exponent[axis]);
+        }
+    }
+
+    int test_children_scalar(const BVH8Node &node, const BVH8::Ray &ray, const float tmax, float tnear[8]) {
+        float a[3], b[3];
+        axis_factors(node, ray, a, b);
+
+        int mask = 0;
+        for (int i = 0; i < 8; ++i) {
+            if (!(node.valid & 1 << i))
+                continue;
+            float t0 = 0, t1 = tmax;
+            for (int axis = 0; axis < 3; ++axis) {
+                float tl = a[axis] + node.lo[axis][i] * b[axis];
+                float th = a[axis] + node.hi[axis][i] * b[axis];
+                if (tl > th)
+                    std::swap(tl, th);
+                t0 = tl > t0 ? tl : t0;
+                t1 = th < t1 ? th : t1;
+            }
+            if (t0 <= t1) {
+                mask |= 1 << i;
+                tnear[i] = t0;
+            }
+        }
+        return mask;
+    }
+
+#if defined(SIMPLERAYTRACER_X86) && defined(__SSE2__)
+    __m128 load_u8x4(const uint8_t *p) {
+        int packed;
+        std::memcpy(&packed, p, sizeof(packed));
+        const __m128i zero = _mm_setzero_si128();
+        __m128i x = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+    }
+
+    // two halves of four children, sse2 is always there on x86-64
+    int test_children_sse(const BVH8Node &node, const BVH8::Ray &ray, const float tmax, float tnear[8]) {
+        float a[3], b[3];
+        axis_factors(node, ray, a, b);
+
+        int mask = 0;
+        for (int half = 0; half < 8; half += 4) {
+            __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tmax);
+            for (int axis = 0; axis < 3; ++axis) {
+                const __m128 va = _mm_set1_ps(a[axis]), vb = _mm_set1_ps(b[axis]);
+                __m128 tl = _mm_add_ps(va, _mm_mul_ps(load_u8x4(&node.lo[axis][half]), vb));
+                __m128 th = _mm_add_ps(va, _mm_mul_ps(load_u8x4(&node.hi[axis][half]), vb));
+                t0 = _mm_max_ps(_mm_min_ps(tl, th), t0);
+                t1 = _mm_min_ps(_mm_max_ps(tl, th), t1);
+            }
+            _mm_storeu_ps(tnear + half, t0);
+            mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << half;
+        }
+        return mask & node.valid;
+    }
+#endif
+
+#ifdef SIMPLERAYTRACER_X86
+    __attribute__((target("avx2")))
+    __m256 load_u8x8(const uint8_t *p) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))));
+    }
+
+    // all eight children in one register per bound
+    __attribute__((target("avx2")))
+    int test_children_avx2(const BVH8Node &node, const BVH8::Ray &ray, const float tmax, float tnear[8]) {
+        float a[3], b[3];
+        axis_factors(node, ray, a, b);
+
+        __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(tmax);
+        for (int axis = 0; axis < 3; ++axis) {
+            const __m256 va = _mm256_set1_ps(a[axis]), vb = _mm256_set1_ps(b[axis]);
+            __m256 tl = _mm256_add_ps(va, _mm256_mul_ps(load_u8x8(node.lo[axis]), vb));
+            __m256 th = _mm256_add_ps(va, _mm256_mul_ps(load_u8x8(node.hi[axis]), vb));
+            t0 = _mm256_max_ps(_mm256_min_ps(tl, th), t0);
+            t1 = _mm256_min_ps(_mm256_max_ps(tl, th), t1);
+        }
+        _mm256_storeu_ps(tnear, t0);
+        return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & node.valid;
+    }
+#endif
+}
+
+BVH8::ChildTest BVH8::childTest() {
+#ifdef SIMPLERAYTRACER_X86
+    if (cpu_supports_avx2())
+        return test_children_avx2;
+#endif
+#if defined(SIMPLERAYTRACER_X86) && defined(__SSE2__)
+    return test_children_sse;
+#else
+    return test_children_scalar;
+#endif
+}
+
+const char *BVH8::childTestName() {
+    ChildTest test = childTest();
+#ifdef SIMPLERAYTRACER_X86
+    if (test == test_children_avx2)
+        return "avx2";
+#endif
+    return test == test_children_scalar ? "scalar" : "sse";
+}
+
+void BVH8::build(const BVH &bvh) {
+    nodes.clear();
+    primIndices = bvh.getPrimIndices();
+    if (bvh.empty())
+        return;
+
+    nodes.emplace_back();
+    collapse(bvh, 0, 0);
+}
+
+// pulls up to eight descendants of a binary node into one wide node, always opening the biggest inner one
+void BVH8::collapse(const BVH &bvh, const int binaryIdx, const int nodeIdx) {
+    const std::vector<BVHNode> &binary = bvh.getNodes();
+
+    int children[8];
+    int n = 0;
+    if (binary[binaryIdx].isLeaf()) {
+        children[n++] = binaryIdx;
+    } else {
+        children[n++] = binary[binaryIdx].leftFirst;
+        children[n++] = binary[binaryIdx].leftFirst + 1;
+    }
+    while (n < 8) {
+        int best = -1;
+        float bestArea = -1;
+        for (int i = 0; i < n; ++i) {
+            const BVHNode &c = binary[children[i]];
+            if (!c.isLeaf() && c.bounds.area() > bestArea) {
+                best = i;
+                bestArea = c.bounds.area();
+            }
+        }
+        if (best < 0)
+            break;
+        const int left = binary[children[best]].leftFirst;
+        children[best] = left;
+        children[n++] = left + 1;
+    }
+
+    BVH8Node node;
+    std::memset(&node, 0, sizeof(node));
+    const AABB &bounds = binary[binaryIdx].bounds;
+    float scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        // smallest power of two step that still spans the node in 255 steps
+        int e;
+        std::frexp((bounds.max[axis] - bounds.min[axis]) / 255.f, &e);
+        e = std::max(-127, std::min(127, e));
+        node.origin[axis] = bounds.min[axis];
+        node.exponent[axis] = static_cast<int8_t>(e);
+        scale[axis] = std::ldexp(1.f, e);
+    }
+
+    int inner = static_cast<int>(nodes.size());
+    for (int i = 0; i < n; ++i) {
+        const BVHNode &c = binary[children[i]];
+        node.valid |= 1 << i;
+        for (int axis = 0; axis < 3; ++axis) {
+            // round outwards, the decoded box must never be smaller than the real one
+            const float o = node.origin[axis], s = scale[axis];
+            int lo = std::max(0, std::min(255, static_cast<int>(std::floor((c.bounds.min[axis] - o) / s))));
+            int hi = std::max(0, std::min(255, static_cast<int>(std::ceil((c.bounds.max[axis] - o) / s))));
+            while (lo > 0 && o + lo * s > c.bounds.min[axis])
+                --lo;
+            while (hi < 255 && o + hi * s < c.bounds.max[axis])
+                ++hi;
+            node.lo[axis][i] = static_cast<uint8_t>(lo);
+            node.hi[axis][i] = static_cast<uint8_t>(hi);
+        }
+        if (c.isLeaf()) {
+            node.child[i] = c.leftFirst;
+            node.count[i] = c.count;
+        } else {
+            node.child[i] = inner++;
+        }
+    }
+    nodes[nodeIdx] = node;
+    nodes.resize(inner);
+
+    for (int i = 0; i < n; ++i) {
+        if (!node.count[i])
+            collapse(bvh, children[i], node.child[i]);
+    }
+}
+
+bool BVH8::empty() const {
+    return nodes.empty();
+}
+
+int BVH8::nnodes() const {
+    return static_cast<int>(nodes.size());
+}
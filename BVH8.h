@@ -0,0 +1,151 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_BVH8_H
+#define SIMPLERAYTRACER_BVH8_H
+
+#include <cstdint>
+#include "BVH.h"
+
+// eight children per node, their boxes are stored as 8 bit offsets from the node origin in steps of 2^exponent,
+// so one node takes two cache lines instead of the eight binary nodes it replaces
+struct BVH8Node {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t valid;      // bit i is set when child i is used
+    uint8_t lo[3][8];   // per axis quantized child bounds, laid out for loading all eight children at once
+    uint8_t hi[3][8];
+    int child[8];       // index of the child node, or of the first primitive of a leaf child
+    int count[8];       // number of primitives of a leaf child, 0 for inner children
+};
+
+class BVH8 {
+    std::vector<BVH8Node> nodes;
+    std::vector<int> primIndices;
+
+    void collapse(const BVH &bvh, int binaryIdx, int nodeIdx);
+
+public:
+    // decoded ray data shared by every node test of one traversal
+    struct Ray {
+        float origin[3];
+        float invDir[3];
+    };
+
+    // tests the ray against all children, fills entry distances of the hit ones and returns their mask
+    typedef int (*ChildTest)(const BVH8Node &node, const Ray &ray, float tmax, float tnear[8]);
+
+    // the widest node test the cpu supports: avx2, sse or scalar
+    static ChildTest childTest();
+
+    static const char *childTestName();
+
+    // collapses a built binary tree, leaves keep their primitive ranges
+    void build(const BVH &bvh);
+
+    bool empty() const;
+
+    int nnodes() const;
+
+    template<typename PrimTest>
+    bool intersect(const Vec3f &origin, const Vec3f &dir, float &tnear, PrimTest test) const;
+
+    // leaf ranges are the ones of the binary tree, see BVH::intersectLeaves()
+    template<typename LeafTest>
+    bool intersectLeaves(const Vec3f &origin, const Vec3f &dir, float &tnear, LeafTest test) const;
+
+    // see BVH::occludedLeaves()
+    template<typename LeafTest>
+    bool occludedLeaves(const Vec3f &origin, const Vec3f &dir, float tmax, LeafTest test) const;
+};
+
+template<typename PrimTest>
+bool BVH8::intersect(const Vec3f &origin, const Vec3f &dir, float &tnear, PrimTest test) const {
+    return intersectLeaves(origin, dir, tnear, [&](const int first, const int count, float &t) {
+        bool found = false;
+        for (int i = first; i < first + count; ++i)
+            if (test(primIndices[i], t))
+                found = true;
+        return found;
+    });
+}
+
+template<typename LeafTest>
+bool BVH8::intersectLeaves(const Vec3f &origin, const Vec3f &dir, float &tnear, LeafTest test) const {
+    if (nodes.empty())
+        return false;
+
+    static const ChildTest testChildren = childTest();
+    const Ray ray = {{origin.x, origin.y, origin.z}, {1.f / dir.x, 1.f / dir.y, 1.f / dir.z}};
+
+    // every visited node pushes at most seven children more than it pops
+    struct Entry {
+        int child;
+        int count;
+        float t;
+    } stack[7 * BVH::maxDepth + 1];
+    int stackSize = 0;
+    stack[stackSize].child = 0;
+    stack[stackSize].count = 0;
+    stack[stackSize++].t = 0;
+    bool found = false;
+
+    while (stackSize) {
+        const Entry entry = stack[--stackSize];
+        if (entry.t > tnear)
+            continue;
+
+        if (entry.count) {
+            if (test(entry.child, entry.count, tnear))
+                found = true;
+            continue;
+        }
+
+        const BVH8Node &node = nodes[entry.child];
+        float t[8];
+        int mask = testChildren(node, ray, tnear, t);
+
+        // push the hit children far to near, so the nearest one is popped first
+        const int first = stackSize;
+        for (int i = 0; i < 8; ++i) {
+            if (!(mask & 1 << i))
+                continue;
+            int j = stackSize++;
+            for (; j > first && stack[j - 1].t < t[i]; --j)
+                stack[j] = stack[j - 1];
+            stack[j].child = node.child[i];
+            stack[j].count = node.count[i];
+            stack[j].t = t[i];
+        }
+    }
+    return found;
+}
+
+template<typename LeafTest>
+bool BVH8::occludedLeaves(const Vec3f &origin, const Vec3f &dir, const float tmax, LeafTest test) const {
+    if (nodes.empty())
+        return false;
+
+    static const ChildTest testChildren = childTest();
+    const Ray ray = {{origin.x, origin.y, origin.z}, {1.f / dir.x, 1.f / dir.y, 1.f / dir.z}};
+
+    // leaves are tested right away, so only inner children go on the stack
+    int stack[7 * BVH::maxDepth + 1];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize) {
+        const BVH8Node &node = nodes[stack[--stackSize]];
+        float t[8];
+        for (int mask = testChildren(node, ray, tmax, t); mask; mask &= mask - 1) {
+            const int i = __builtin_ctz(static_cast<unsigned>(mask));
+            if (!node.count[i])
+                stack[stackSize++] = node.child[i];
+            else if (test(node.child[i], node.count[i]))
+                return true;
+        }
+    }
+    return false;
+}
+
+#endif //SIMPLERAYTRACER_BVH8_H
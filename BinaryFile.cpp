@@ -0,0 +1,128 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "BinaryFile.h"
+
+namespace {
+    const uint64_t alignment = 64;
+
+    uint64_t align(const uint64_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    // chained hash of the section table and every array, padding between arrays is not covered
+    uint64_t checksum(const BinarySection *table, const void *const *arrays, const uint32_t count) {
+        uint64_t h = hash_bytes(table, count * sizeof(BinarySection));
+        for (uint32_t i = 0; i < count; ++i)
+            h = hash_bytes(arrays[i], table[i].count * table[i].elemSize, h);
+        return h;
+    }
+}
+
+void BinaryWriter::add(const uint32_t id, const void *data, const uint32_t elemSize, const uint64_t count) {
+    BinarySection section = {id, elemSize, 0, count};
+    sections.push_back(section);
+    arrays.push_back(data);
+}
+
+bool BinaryWriter::write(const std::string &filename, const char *magic, const uint32_t version,
+                         const uint64_t key) const {
+    std::vector<BinarySection> table(sections);
+    uint64_t offset = align(sizeof(BinaryFileHeader) + table.size() * sizeof(BinarySection));
+    for (auto &section : table) {
+        section.offset = offset;
+        offset = align(offset + section.count * section.elemSize);
+    }
+
+    BinaryFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, magic, std::min(std::strlen(magic), sizeof(header.magic)));
+    header.version = version;
+    header.sectionCount = static_cast<uint32_t>(table.size());
+    header.key = key;
+    header.checksum = checksum(table.data(), arrays.data(), header.sectionCount);
+
+    const std::string tmp = filename + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    if (out.fail())
+        return false;
+    const char padding[alignment] = {};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(BinarySection));
+    uint64_t written = sizeof(header) + table.size() * sizeof(BinarySection);
+    for (size_t i = 0; i < table.size(); ++i) {
+        out.write(padding, static_cast<std::streamsize>(table[i].offset - written));
+        out.write(static_cast<const char *>(arrays[i]),
+                  static_cast<std::streamsize>(table[i].count * table[i].elemSize));
+        written = table[i].offset + table[i].count * table[i].elemSize;
+    }
+    out.close();
+    if (out.fail()) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return std::rename(tmp.c_str(), filename.c_str()) == 0;
+}
+
+BinaryReader::BinaryReader() : file(), header(nullptr), sections(nullptr) {}
+
+bool BinaryReader::open(const std::string &filename, const char *magic, const uint32_t version, const uint64_t key,
+                        const bool verify, const bool copyOnWrite) {
+    file = std::make_shared<MappedFile>(filename, copyOnWrite);
+    header = nullptr;
+    sections = nullptr;
+    if (!file->valid() || file->size() < sizeof(BinaryFileHeader))
+        return false;
+
+    const auto *h = reinterpret_cast<const BinaryFileHeader *>(file->data());
+    if (std::strncmp(h->magic, magic, sizeof(h->magic)) != 0 || h->version != version || h->key != key)
+        return false;
+    if (file->size() < sizeof(BinaryFileHeader) + uint64_t(h->sectionCount) * sizeof(BinarySection))
+        return false;
+
+    const auto *table = reinterpret_cast<const BinarySection *>(file->data() + sizeof(BinaryFileHeader));
+    for (uint32_t i = 0; i < h->sectionCount; ++i) {
+        if (table[i].offset > file->size() ||
+            (table[i].elemSize && table[i].count > (file->size() - table[i].offset) / table[i].elemSize))
+            return false;
+    }
+    if (verify) {
+        std::vector<const void *> arrays(h->sectionCount);
+        for (uint32_t i = 0; i < h->sectionCount; ++i)
+            arrays[i] = file->data() + table[i].offset;
+        if (::checksum(table, arrays.data(), h->sectionCount) != h->checksum)
+            return false;
+    }
+
+    header = h;
+    sections = table;
+    return true;
+}
+
+uint64_t BinaryReader::checksum() const {
+    return header ? header->checksum : 0;
+}
+
+const std::shared_ptr<MappedFile> &BinaryReader::mapping() const {
+    return file;
+}
+
+const void *BinaryReader::find(const uint32_t id, const uint32_t elemSize, uint64_t &count) const {
+    count = 0;
+    if (!header)
+        return nullptr;
+    for (uint32_t i = 0; i < header->sectionCount; ++i) {
+        if (sections[i].id == id) {
+            if (sections[i].elemSize != elemSize)
+                return nullptr;
+            count = sections[i].count;
+            return file->data() + sections[i].offset;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,75 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_BINARYFILE_H
+#define SIMPLERAYTRACER_BINARYFILE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "MappedFile.h"
+
+// a header, a table of typed sections and the section arrays, each one aligned to a cache line,
+// so a mapped file can be used in place
+struct BinaryFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t key;      // whatever the file was made from, stale files have a different one
+    uint64_t checksum; // hash of everything after the header
+};
+
+struct BinarySection {
+    uint32_t id;
+    uint32_t elemSize;
+    uint64_t offset;
+    uint64_t count;
+};
+
+class BinaryWriter {
+    std::vector<BinarySection> sections;
+    std::vector<const void *> arrays;
+
+public:
+    void add(uint32_t id, const void *data, uint32_t elemSize, uint64_t count);
+
+    template<typename T>
+    void add(uint32_t id, const T *data, size_t count) {
+        add(id, data, sizeof(T), count);
+    }
+
+    // writes next to the target and renames, readers never see a half written file
+    bool write(const std::string &filename, const char *magic, uint32_t version, uint64_t key) const;
+};
+
+class BinaryReader {
+    std::shared_ptr<MappedFile> file;
+    const BinaryFileHeader *header;
+    const BinarySection *sections;
+
+    const void *find(uint32_t id, uint32_t elemSize, uint64_t &count) const;
+
+public:
+    BinaryReader();
+
+    // maps the file and checks magic, version, key and, when verify is set, the checksum;
+    // sections of a copy on write mapping may be modified in place
+    bool open(const std::string &filename, const char *magic, uint32_t version, uint64_t key, bool verify = true,
+              bool copyOnWrite = false);
+
+    // checksum stored in the header, identifies the contents without reading them
+    uint64_t checksum() const;
+
+    // the mapping stays alive as long as any copy of this pointer
+    const std::shared_ptr<MappedFile> &mapping() const;
+
+    // nullptr when the section is missing or its elements are not of this size
+    template<typename T>
+    const T *section(uint32_t id, uint64_t &count) const {
+        return static_cast<const T *>(find(id, sizeof(T), count));
+    }
+};
+
+#endif //SIMPLERAYTRACER_BINARYFILE_H
@@ -0,0 +1,102 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_BUFFER_H
+#define SIMPLERAYTRACER_BUFFER_H
+
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+#include "MappedFile.h"
+
+// std::vector allocator for arrays that simd code loads with aligned instructions
+template<typename T, size_t Alignment>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    template<typename U>
+    struct rebind {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    AlignedAllocator() = default;
+
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+    T *allocate(const size_t n) {
+        void *p = nullptr;
+        if (posix_memalign(&p, Alignment, n * sizeof(T)))
+            throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, size_t) { std::free(p); }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Alignment> &) const { return true; }
+
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment> &) const { return false; }
+};
+
+// array that either owns its elements or points into a mapped file, which it then keeps alive;
+// mapped elements are copy on write, so editing them touches the process copy only, and shared by moves only:
+// a copy of a mapped buffer owns its elements, so editing one never shows through the other
+template<typename T>
+class Buffer {
+    std::vector<T> owned;
+    std::shared_ptr<MappedFile> mapping;
+    T *ptr;
+    size_t n;
+
+public:
+    Buffer() : owned(), mapping(), ptr(nullptr), n(0) {}
+
+    Buffer(std::vector<T> &&v) : owned(std::move(v)), mapping(), ptr(owned.data()), n(owned.size()) {}
+
+    Buffer(const std::shared_ptr<MappedFile> &m, const T *p, const size_t count) :
+            owned(), mapping(m), ptr(const_cast<T *>(p)), n(count) {}
+
+    Buffer(const Buffer &other) : owned(other.ptr, other.ptr + other.n), mapping(), ptr(owned.data()), n(other.n) {}
+
+    Buffer(Buffer &&other) noexcept : owned(std::move(other.owned)), mapping(std::move(other.mapping)),
+                                      ptr(mapping ? other.ptr : owned.data()), n(other.n) {
+        other.ptr = nullptr;
+        other.n = 0;
+    }
+
+    Buffer &operator=(Buffer other) {
+        owned.swap(other.owned);
+        mapping.swap(other.mapping);
+        ptr = mapping ? other.ptr : owned.data();
+        n = other.n;
+        return *this;
+    }
+
+    bool mapped() const { return static_cast<bool>(mapping); }
+
+    size_t size() const { return n; }
+
+    bool empty() const { return !n; }
+
+    T *data() { return ptr; }
+
+    const T *data() const { return ptr; }
+
+    T &operator[](const size_t i) { return ptr[i]; }
+
+    const T &operator[](const size_t i) const { return ptr[i]; }
+
+    T *begin() { return ptr; }
+
+    T *end() { return ptr + n; }
+
+    const T *begin() const { return ptr; }
+
+    const T *end() const { return ptr + n; }
+};
+
+#endif //SIMPLERAYTRACER_BUFFER_H
@@ -0,0 +1,31 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_CPU_H
+#define SIMPLERAYTRACER_CPU_H
+
+// simd kernels are compiled per function with target attributes and picked at runtime,
+// so one binary runs everywhere and still uses the widest instructions available
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SIMPLERAYTRACER_X86 1
+#include <immintrin.h>
+#endif
+
+inline bool cpu_supports_avx2() {
+#ifdef SIMPLERAYTRACER_X86
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+inline bool cpu_supports_avx512() {
+#ifdef SIMPLERAYTRACER_X86
+    return __builtin_cpu_supports("avx512f");
+#else
+    return false;
+#endif
+}
+
+#endif //SIMPLERAYTRACER_CPU_H
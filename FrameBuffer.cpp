@@ -0,0 +1,10 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <algorithm>
+#include "FrameBuffer.h"
+
+FrameBuffer::FrameBuffer(const int width, const int height, const int tileSize) :
+        w(width), h(height), tile(std::max(tileSize, 1)), tilesX((width + tile - 1) / tile),
+        pixels(static_cast<size_t>(tilesX) * ((height + tile - 1) / tile) * tile * tile) {}
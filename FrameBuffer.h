@@ -0,0 +1,65 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_FRAMEBUFFER_H
+#define SIMPLERAYTRACER_FRAMEBUFFER_H
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+
+// gathers the even bits of code into the low half, the inverse of spreading a coordinate for a 2d morton code
+inline uint32_t compact_bits(uint32_t code) {
+    code &= 0x55555555u;
+    code = (code | code >> 1) & 0x33333333u;
+    code = (code | code >> 2) & 0x0f0f0f0fu;
+    code = (code | code >> 4) & 0x00ff00ffu;
+    code = (code | code >> 8) & 0x0000ffffu;
+    return code;
+}
+
+// calls f(x, y) for every cell of a w x h grid along the z curve, cells of the enclosing power of two square
+// that fall outside are skipped
+template<typename F>
+void for_each_morton(const int w, const int h, F f) {
+    uint32_t side = 1;
+    while (side < static_cast<uint32_t>(w) || side < static_cast<uint32_t>(h))
+        side <<= 1;
+    for (uint32_t code = 0; code < side * side; ++code) {
+        const int x = static_cast<int>(compact_bits(code)), y = static_cast<int>(compact_bits(code >> 1));
+        if (x < w && y < h)
+            f(x, y);
+    }
+}
+
+// pixels stored tile by tile: every tile x tile square of the image is one contiguous block, rows inside it,
+// so whoever renders a tile writes a few kilobytes instead of touching tile rows spread over the whole image.
+// edge tiles are stored whole, pixels past the image edge are never read
+class FrameBuffer {
+    int w, h, tile, tilesX;
+    std::vector<Vec3f> pixels;
+
+    size_t tileStart(const int x, const int y) const {
+        return static_cast<size_t>(y / tile * tilesX + x / tile) * tile * tile;
+    }
+
+public:
+    FrameBuffer(int width, int height, int tileSize);
+
+    int width() const { return w; }
+
+    int height() const { return h; }
+
+    int tileSize() const { return tile; }
+
+    // first pixel of the tile holding (x, y), the pixel (x, y) of a tile starting at (x0, y0) is at
+    // (y - y0) * tileSize() + x - x0
+    Vec3f *tileData(const int x, const int y) { return pixels.data() + tileStart(x, y); }
+
+    Vec3f &at(const int x, const int y) { return pixels[tileStart(x, y) + y % tile * tile + x % tile]; }
+
+    const Vec3f &at(const int x, const int y) const { return pixels[tileStart(x, y) + y % tile * tile + x % tile]; }
+};
+
+#endif //SIMPLERAYTRACER_FRAMEBUFFER_H
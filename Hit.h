@@ -0,0 +1,22 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_HIT_H
+#define SIMPLERAYTRACER_HIT_H
+
+#include <limits>
+
+// what closest hit queries record on the way, hit point, normal and material are rebuilt from it once at the end
+struct Hit {
+    float t;
+    int prim;     // face of a mesh, or whatever the caller numbers its primitives with; -1 until something is hit
+    int instance; // instance of the mesh when the hit came through a TLAS
+    float u, v;   // barycentric coordinates on a triangle, the hit point is (1 - u - v) * v0 + u * v1 + v * v2
+
+    explicit Hit(const float tmax = std::numeric_limits<float>::max()) : t(tmax), prim(-1), instance(-1), u(0), v(0) {}
+
+    bool found() const { return prim >= 0; }
+};
+
+#endif //SIMPLERAYTRACER_HIT_H
@@ -0,0 +1,186 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include "Instance.h"
+
+Transform::Transform() {
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 4; ++j)
+            m[i][j] = i == j ? 1 : 0;
+}
+
+Transform Transform::translation(const Vec3f &t) {
+    Transform r;
+    for (int i = 0; i < 3; ++i)
+        r.m[i][3] = t[i];
+    return r;
+}
+
+Transform Transform::scale(const float s) {
+    Transform r;
+    for (int i = 0; i < 3; ++i)
+        r.m[i][i] = s;
+    return r;
+}
+
+Transform Transform::rotationY(const float radians) {
+    Transform r;
+    r.m[0][0] = r.m[2][2] = cosf(radians);
+    r.m[0][2] = sinf(radians);
+    r.m[2][0] = -r.m[0][2];
+    return r;
+}
+
+Transform Transform::operator*(const Transform &rhs) const {
+    Transform r;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            r.m[i][j] = j == 3 ? m[i][3] : 0;
+            for (int k = 0; k < 3; ++k)
+                r.m[i][j] += m[i][k] * rhs.m[k][j];
+        }
+    }
+    return r;
+}
+
+Vec3f Transform::point(const Vec3f &p) const {
+    return vector(p) + Vec3f(m[0][3], m[1][3], m[2][3]);
+}
+
+Vec3f Transform::vector(const Vec3f &v) const {
+    return Vec3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                 m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                 m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+}
+
+Vec3f Transform::transposedVector(const Vec3f &v) const {
+    return Vec3f(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                 m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                 m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+}
+
+Transform Transform::inverse() const {
+    // adjugate over determinant for the linear part, then the translation goes backwards through it
+    Transform r;
+    float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    float invDet = 1 / det;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            r.m[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) * invDet;
+        }
+    }
+    Vec3f t = r.vector(Vec3f(m[0][3], m[1][3], m[2][3]));
+    for (int i = 0; i < 3; ++i)
+        r.m[i][3] = -t[i];
+    return r;
+}
+
+int TLAS::addMesh(Model &&mesh) {
+    meshes.push_back(std::move(mesh));
+    return static_cast<int>(meshes.size()) - 1;
+}
+
+int TLAS::addInstance(const int mesh, const Transform &toWorld, const MaterialId material) {
+    instances.emplace_back(mesh, toWorld, material);
+    return static_cast<int>(instances.size()) - 1;
+}
+
+void TLAS::setTransform(const int instance, const Transform &toWorld) {
+    instances[instance].toWorld = toWorld;
+    instances[instance].toObject = toWorld.inverse();
+}
+
+void TLAS::build() {
+    std::vector<AABB> worldBounds(instances.size());
+    for (size_t i = 0; i < instances.size(); ++i) {
+        const AABB b = meshes[instances[i].mesh].bounds();
+        if (b.empty())
+            continue;
+        for (int corner = 0; corner < 8; ++corner) {
+            Vec3f p(corner & 1 ? b.max.x : b.min.x, corner & 2 ? b.max.y : b.min.y, corner & 4 ? b.max.z : b.min.z);
+            worldBounds[i].grow(instances[i].toWorld.point(p));
+        }
+    }
+    bvh.build(worldBounds);
+    std::cout << "# tlas meshes# " << meshes.size() << " instances# " << instances.size()
+              << " built in " << bvh.lastBuildTime() << "ms" << std::endl;
+}
+
+int TLAS::nmeshes() const {
+    return static_cast<int>(meshes.size());
+}
+
+int TLAS::ninstances() const {
+    return static_cast<int>(instances.size());
+}
+
+// the ray goes to object space unnormalized, so distances along it stay the same in both spaces
+bool TLAS::ray_intersect(const Vec3f &origin, const Vec3f &dir, Hit &hit) const {
+    Hit best(hit.t);
+    float tnear = hit.t;
+    bvh.intersect(origin, dir, tnear, [&](const int i, float &t) {
+        const Instance &instance = instances[i];
+        Hit local(t);
+        if (!meshes[instance.mesh].ray_intersect(instance.toObject.point(origin), instance.toObject.vector(dir),
+                                                 local))
+            return false;
+        best = local;
+        best.instance = i;
+        t = local.t;
+        return true;
+    });
+    if (!best.found())
+        return false;
+    hit = best;
+    return true;
+}
+
+Vec3f TLAS::normal(const Hit &hit) const {
+    const Instance &instance = instances[hit.instance];
+    return instance.toObject.transposedVector(meshes[instance.mesh].normal(hit.prim));
+}
+
+MaterialId TLAS::material(const Hit &hit) const {
+    return instances[hit.instance].material;
+}
+
+bool TLAS::occluded(const Vec3f &origin, const Vec3f &dir, const float tmax) const {
+    const std::vector<int> &refs = bvh.getPrimIndices();
+    return bvh.occludedLeaves(origin, dir, tmax, [&](const int first, const int count) {
+        for (int p = first; p < first + count; ++p) {
+            const Instance &instance = instances[refs[p]];
+            if (meshes[instance.mesh].occluded(instance.toObject.point(origin), instance.toObject.vector(dir), tmax))
+                return true;
+        }
+        return false;
+    });
+}
+
+// every instance gets the packet in its object space, the origin stays shared since transforms are affine
+uint64_t TLAS::intersectPacket(RayPacket &packet, const uint64_t active, Hit *hits) const {
+    uint64_t found = 0;
+    bvh.intersectPacket(packet, active, [&](const int first, const int count, const uint64_t mask) {
+        const std::vector<int> &refs = bvh.getPrimIndices();
+        for (int p = first; p < first + count; ++p) {
+            const Instance &instance = instances[refs[p]];
+            RayPacket local(instance.toObject.point(packet.origin));
+            for (int r = 0; r < packet.size; ++r)
+                local.add(instance.toObject.vector(packet.direction(r)), packet.tnear[r]);
+            local.prepare();
+
+            Hit localHits[RayPacket::maxSize];
+            uint64_t hit = meshes[instance.mesh].intersectPacket(local, mask, localHits);
+            for (found |= hit; hit; hit &= hit - 1) {
+                const int r = __builtin_ctzll(hit);
+                packet.tnear[r] = local.tnear[r];
+                hits[r] = localHits[r];
+                hits[r].instance = refs[p];
+            }
+        }
+    });
+    return found;
+}
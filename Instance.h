@@ -0,0 +1,84 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_INSTANCE_H
+#define SIMPLERAYTRACER_INSTANCE_H
+
+#include "geometry.h"
+#include "Material.h"
+#include "Model.h"
+#include "BVH.h"
+#include "RayPacket.h"
+
+// affine transform stored as the upper 3x4 part of a 4x4 matrix
+struct Transform {
+    float m[3][4];
+
+    Transform();
+
+    static Transform translation(const Vec3f &t);
+
+    static Transform scale(float s);
+
+    static Transform rotationY(float radians);
+
+    Transform operator*(const Transform &rhs) const;
+
+    Vec3f point(const Vec3f &p) const;
+
+    Vec3f vector(const Vec3f &v) const;
+
+    // multiplies by the transposed linear part, so the inverse transform carries normals the other way
+    Vec3f transposedVector(const Vec3f &v) const;
+
+    Transform inverse() const;
+};
+
+// one placement of a shared mesh, costs a couple of transforms and a material index no matter how big the mesh is
+struct Instance {
+    int mesh;
+    Transform toWorld;
+    Transform toObject;
+    MaterialId material;
+
+    Instance(int m, const Transform &t, const MaterialId mat) :
+            mesh(m), toWorld(t), toObject(t.inverse()), material(mat) {}
+};
+
+// top level acceleration structure: a bvh over the world bounds of instances, every unique mesh keeps its own bvh
+class TLAS {
+    std::vector<Model> meshes;
+    std::vector<Instance> instances;
+    BVH bvh;
+
+public:
+    int addMesh(Model &&mesh);
+
+    int addInstance(int mesh, const Transform &toWorld, MaterialId material);
+
+    // moving an instance only invalidates the top level tree, call build() afterwards
+    void setTransform(int instance, const Transform &toWorld);
+
+    void build();
+
+    int nmeshes() const;
+
+    int ninstances() const;
+
+    // closest hit closer than hit.t, sets the instance as well
+    bool ray_intersect(const Vec3f &origin, const Vec3f &dir, Hit &hit) const;
+
+    // world space normal of a hit, unnormalized
+    Vec3f normal(const Hit &hit) const;
+
+    MaterialId material(const Hit &hit) const;
+
+    // any instance hit closer than tmax
+    bool occluded(const Vec3f &origin, const Vec3f &dir, float tmax) const;
+
+    // packet version of ray_intersect(), returns the mask of the rays that hit an instance
+    uint64_t intersectPacket(RayPacket &packet, uint64_t active, Hit *hits) const;
+};
+
+#endif //SIMPLERAYTRACER_INSTANCE_H
@@ -0,0 +1,178 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <cstdint>
+#include "BVH.h"
+#include "Parallel.h"
+
+namespace {
+    // ranges with fewer primitives are sorted and emitted on one thread
+    const int parallelThreshold = 1 << 14;
+
+    int leading_zeros(const uint64_t x) {
+#if defined(__GNUC__)
+        return x ? __builtin_clzll(x) : 64;
+#else
+        int n = 0;
+        for (uint64_t bit = uint64_t(1) << 63; bit && !(x & bit); bit >>= 1)
+            ++n;
+        return n;
+#endif
+    }
+
+    // spreads the lower 10 bits of x so that there are two zero bits between every two of them
+    uint64_t expand_bits10(uint64_t x) {
+        x &= 0x3ff;
+        x = (x | x << 16) & 0x30000ff;
+        x = (x | x << 8) & 0x300f00f;
+        x = (x | x << 4) & 0x30c30c3;
+        x = (x | x << 2) & 0x9249249;
+        return x;
+    }
+
+    // same for the lower 21 bits
+    uint64_t expand_bits21(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffULL;
+        x = (x | x << 16) & 0x1f0000ff0000ffULL;
+        x = (x | x << 8) & 0x100f00f00f00f00fULL;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+        x = (x | x << 2) & 0x1249249249249249ULL;
+        return x;
+    }
+
+    // stable least significant digit radix sort of (code, prim) pairs by the lower keyBits of code,
+    // every pass builds one digit histogram per chunk and scatters the chunks concurrently
+    void radix_sort(std::vector<uint64_t> &codes, std::vector<int> &prims, const int keyBits) {
+        const int n = static_cast<int>(codes.size());
+        const int chunks = chunk_count(0, n, parallelThreshold);
+        std::vector<uint64_t> codesTmp(n);
+        std::vector<int> primsTmp(n);
+        std::vector<int> offsets(chunks * 256);
+
+        for (int shift = 0; shift < keyBits; shift += 8) {
+            std::fill(offsets.begin(), offsets.end(), 0);
+            parallel_chunks(0, n, chunks, [&](const int c, const int b, const int e) {
+                for (int i = b; i < e; ++i)
+                    ++offsets[c * 256 + (codes[i] >> shift & 0xff)];
+            });
+
+            int sum = 0;
+            for (int digit = 0; digit < 256; ++digit) {
+                for (int c = 0; c < chunks; ++c) {
+                    int cnt = offsets[c * 256 + digit];
+                    offsets[c * 256 + digit] = sum;
+                    sum += cnt;
+                }
+            }
+
+            parallel_chunks(0, n, chunks, [&](const int c, const int b, const int e) {
+                int *offset = &offsets[c * 256];
+                for (int i = b; i < e; ++i) {
+                    int dst = offset[codes[i] >> shift & 0xff]++;
+                    codesTmp[dst] = codes[i];
+                    primsTmp[dst] = prims[i];
+                }
+            });
+            codes.swap(codesTmp);
+            prims.swap(primsTmp);
+        }
+    }
+}
+
+uint64_t morton_code(const Vec3f &p, const int bitsPerAxis) {
+    const float cells = static_cast<float>(1 << bitsPerAxis);
+    uint64_t q[3];
+    for (size_t i = 0; i < 3; ++i)
+        q[i] = static_cast<uint64_t>(std::min(std::max(p[i] * cells, 0.f), cells - 1));
+    if (bitsPerAxis == 10)
+        return expand_bits10(q[0]) << 2 | expand_bits10(q[1]) << 1 | expand_bits10(q[2]);
+    return expand_bits21(q[0]) << 2 | expand_bits21(q[1]) << 1 | expand_bits21(q[2]);
+}
+
+void BVH::buildLinear(const std::vector<AABB> &primBounds, const std::vector<Vec3f> &centroids) {
+    const int n = static_cast<int>(primBounds.size());
+
+    const int chunks = chunk_count(0, n, parallelThreshold);
+    std::vector<AABB> chunkCentroids(chunks);
+    parallel_chunks(0, n, chunks, [&](const int c, const int b, const int e) {
+        for (int i = b; i < e; ++i)
+            chunkCentroids[c].grow(centroids[i]);
+    });
+    AABB centroidBounds;
+    for (const auto &b : chunkCentroids)
+        centroidBounds.grow(b);
+
+    // 30 bit codes are fine grained enough for small meshes and take half the sorting passes
+    const int bitsPerAxis = n <= (1 << 20) ? 10 : 21;
+    Vec3f extent = centroidBounds.max - centroidBounds.min;
+    Vec3f scale;
+    for (size_t i = 0; i < 3; ++i)
+        scale[i] = extent[i] > 0 ? 1 / extent[i] : 0;
+
+    std::vector<uint64_t> codes(n);
+    parallel_for(0, n, [&](const int i) {
+        Vec3f p = centroids[i] - centroidBounds.min;
+        codes[i] = morton_code(Vec3f(p.x * scale.x, p.y * scale.y, p.z * scale.z), bitsPerAxis);
+    });
+    radix_sort(codes, primIndices, 3 * bitsPerAxis);
+
+    nodes.resize(2 * n - 1);
+    std::atomic<int> nodeCount(1);
+    ThreadPool::instance().reserve(worker_count() - 1);
+    int spawnDepth = 0;
+    while ((1 << spawnDepth) < 2 * worker_count())
+        ++spawnDepth;
+    emitLinear(0, 0, n, 0, spawnDepth, nodeCount, codes, primBounds);
+    nodes.resize(nodeCount);
+}
+
+// splits the sorted range where the highest differing bit of the morton codes flips,
+// node bounds are filled on the way back up
+void BVH::emitLinear(const int nodeIdx, const int first, const int count, const int depth, const int spawnDepth,
+                     std::atomic<int> &nodeCount,
+                     const std::vector<uint64_t> &codes, const std::vector<AABB> &primBounds) {
+    BVHNode &node = nodes[nodeIdx];
+    if (count <= leafLimit() || depth >= maxDepth - 1) {
+        node.bounds = AABB();
+        for (int i = first; i < first + count; ++i)
+            node.bounds.grow(primBounds[primIndices[i]]);
+        node.leftFirst = first;
+        node.count = count;
+        return;
+    }
+
+    const int last = first + count - 1;
+    int mid = first + count / 2;
+    if (codes[first] != codes[last]) {
+        // binary search for the last code sharing more than the common prefix with the first one
+        const int prefix = leading_zeros(codes[first] ^ codes[last]);
+        int split = first;
+        int step = count - 1;
+        do {
+            step = (step + 1) >> 1;
+            if (split + step < last && leading_zeros(codes[first] ^ codes[split + step]) > prefix)
+                split += step;
+        } while (step > 1);
+        mid = split + 1;
+    }
+
+    const int left = nodeCount.fetch_add(2);
+    node.leftFirst = left;
+    node.count = 0;
+    if (spawnDepth > 0 && count >= parallelThreshold) {
+        TaskGroup leftEmitter;
+        leftEmitter.run([&]() {
+            emitLinear(left, first, mid - first, depth + 1, spawnDepth - 1, nodeCount, codes, primBounds);
+        });
+        emitLinear(left + 1, mid, first + count - mid, depth + 1, spawnDepth - 1, nodeCount, codes, primBounds);
+        leftEmitter.wait();
+    } else {
+        emitLinear(left, first, mid - first, depth + 1, 0, nodeCount, codes, primBounds);
+        emitLinear(left + 1, mid, first + count - mid, depth + 1, 0, nodeCount, codes, primBounds);
+    }
+
+    node.bounds = nodes[left].bounds;
+    node.bounds.grow(nodes[left + 1].bounds);
+}
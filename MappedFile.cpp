@@ -0,0 +1,63 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "MappedFile.h"
+
+MappedFile::MappedFile(const std::string &filename, const bool copyOnWrite) : addr(nullptr), length(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *p = mmap(nullptr, static_cast<size_t>(st.st_size),
+                       copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            addr = p;
+            length = static_cast<size_t>(st.st_size);
+        }
+    }
+    // the mapping keeps the file alive on its own
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (addr)
+        munmap(addr, length);
+}
+
+bool MappedFile::valid() const {
+    return addr != nullptr;
+}
+
+const char *MappedFile::data() const {
+    return static_cast<const char *>(addr);
+}
+
+size_t MappedFile::size() const {
+    return length;
+}
+
+uint64_t hash_bytes(const void *data, const size_t size, uint64_t seed) {
+    const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+    const char *p = static_cast<const char *>(data);
+    uint64_t h = seed ^ 0xcbf29ce484222325ULL ^ (size * prime);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        h = (h ^ word) * prime;
+        h ^= h >> 29;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p + i, size - i);
+    h = (h ^ tail) * prime;
+    return h ^ h >> 32;
+}
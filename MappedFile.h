@@ -0,0 +1,37 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_MAPPEDFILE_H
+#define SIMPLERAYTRACER_MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// read only memory mapping of a whole file, pages are loaded on first touch;
+// a copy on write mapping may also be written, the changes stay private to the process
+class MappedFile {
+    void *addr;
+    size_t length;
+
+public:
+    explicit MappedFile(const std::string &filename, bool copyOnWrite = false);
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    bool valid() const;
+
+    const char *data() const;
+
+    size_t size() const;
+};
+
+// 64 bit hash of a byte range, eight bytes per step, seed chains calls over several ranges
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = 0);
+
+#endif //SIMPLERAYTRACER_MAPPEDFILE_H
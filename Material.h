@@ -5,6 +5,11 @@
 #ifndef SIMPLERAYTRACER_MATERIAL_H
 #define SIMPLERAYTRACER_MATERIAL_H
 
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include "geometry.h"
+
 struct Material {
     float refractiveIndex;
     Vec4f albedo;
@@ -17,4 +22,29 @@ struct Material {
             refractiveIndex(r), albedo(a), diffuseColor(c), specularExponent(s) {}
 };
 
+// objects refer to their material by index into the scene's MaterialTable
+typedef uint16_t MaterialId;
+
+// every material of a scene in one place, editing an entry changes all objects using it
+class MaterialTable {
+    std::vector<Material> materials;
+
+public:
+    static const size_t maxSize = 1 << 16;
+
+    // throws std::length_error once every id is taken
+    MaterialId add(const Material &material) {
+        if (materials.size() == maxSize)
+            throw std::length_error("MaterialTable: more than 65536 materials");
+        materials.push_back(material);
+        return static_cast<MaterialId>(materials.size() - 1);
+    }
+
+    size_t size() const { return materials.size(); }
+
+    Material &operator[](const MaterialId id) { return materials[id]; }
+
+    const Material &operator[](const MaterialId id) const { return materials[id]; }
+};
+
 #endif //SIMPLERAYTRACER_MATERIAL_H
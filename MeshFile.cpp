@@ -0,0 +1,67 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <iostream>
+#include "MeshFile.h"
+#include "BinaryFile.h"
+
+namespace {
+    const char meshMagic[] = "SRTMESH";
+    const uint32_t meshVersion = 1;
+
+    enum MeshSection : uint32_t {
+        MeshVerts = 1, MeshFaces, MeshBounds
+    };
+
+    // index of the first face with a vertex index outside [0, nverts), or nfaces when there is none
+    uint64_t first_bad_face(const Vec3i *faces, const uint64_t nfaces, const uint64_t nverts) {
+        for (uint64_t i = 0; i < nfaces; ++i)
+            for (int k = 0; k < 3; ++k)
+                if (faces[i][k] < 0 || static_cast<uint64_t>(faces[i][k]) >= nverts)
+                    return i;
+        return nfaces;
+    }
+}
+
+bool write_mesh(const std::string &filename, const Vec3f *verts, const size_t nverts, const Vec3i *faces,
+                const size_t nfaces, const AABB *bounds) {
+    const uint64_t bad = first_bad_face(faces, nfaces, nverts);
+    if (bad != nfaces) {
+        std::cerr << "Face " << bad << " for " << filename << " has a vertex index out of range" << std::endl;
+        return false;
+    }
+    BinaryWriter writer;
+    writer.add(MeshVerts, verts, nverts);
+    writer.add(MeshFaces, faces, nfaces);
+    if (bounds)
+        writer.add(MeshBounds, bounds, 1);
+    return writer.write(filename, meshMagic, meshVersion, 0);
+}
+
+bool read_mesh(const std::string &filename, Buffer<Vec3f> &verts, Buffer<Vec3i> &faces, AABB &bounds,
+               uint64_t &checksum, const bool verify) {
+    // copy on write, so moving vertices through Model::point() still works on a mapped mesh
+    BinaryReader reader;
+    if (!reader.open(filename, meshMagic, meshVersion, 0, verify, true))
+        return false;
+
+    uint64_t nv, nf, nb;
+    const Vec3f *v = reader.section<Vec3f>(MeshVerts, nv);
+    const Vec3i *f = reader.section<Vec3i>(MeshFaces, nf);
+    if (!v || !f)
+        return false;
+    const uint64_t bad = verify ? first_bad_face(f, nf, nv) : nf;
+    if (bad != nf) {
+        std::cerr << "Face " << bad << " of " << filename << " has a vertex index out of range" << std::endl;
+        return false;
+    }
+    const AABB *b = reader.section<AABB>(MeshBounds, nb);
+    if (b && nb == 1)
+        bounds = *b;
+
+    verts = Buffer<Vec3f>(reader.mapping(), v, nv);
+    faces = Buffer<Vec3i>(reader.mapping(), f, nf);
+    checksum = reader.checksum();
+    return true;
+}
@@ -0,0 +1,29 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_MESHFILE_H
+#define SIMPLERAYTRACER_MESHFILE_H
+
+#include <string>
+#include "geometry.h"
+#include "Buffer.h"
+#include "BVH.h"
+
+// compact binary mesh, a BinaryFile with the vertex and index arrays stored exactly as they are in memory
+// and an optional bounding box, so a mapped file is used as is; little endian only like the bvh cache
+
+// bounds may be nullptr to leave the box out; faces with a vertex index out of range are refused, so every file
+// written here is valid and its checksum covers exactly these arrays
+bool write_mesh(const std::string &filename, const Vec3f *verts, size_t nverts, const Vec3i *faces, size_t nfaces,
+                const AABB *bounds);
+
+// maps the file and points both buffers into it, only the header and the section table are checked and nothing
+// else is read until the arrays are touched; false when the file is not a mesh of this version.
+// verify also checks the checksum and every face index, which reads the whole file, see obj2mesh --check.
+// bounds is left untouched when the file has no box, checksum is the one write_mesh() stored and identifies
+// the contents for the bvh cache
+bool read_mesh(const std::string &filename, Buffer<Vec3f> &verts, Buffer<Vec3i> &faces, AABB &bounds,
+               uint64_t &checksum, bool verify = false);
+
+#endif //SIMPLERAYTRACER_MESHFILE_H
@@ -2,43 +2,69 @@
 // Created by ju5t on 02.02.19.
 //
 
-#include <fstream>
-#include <sstream>
+#include <chrono>
 #include "Model.h"
+#include "Parallel.h"
+#include "BinaryFile.h"
+#include "ObjParser.h"
+#include "MeshFile.h"
 
-// fills verts and faces arrays, supposes .obj file to have "f " entries without slashes
-Model::Model(const std::string &filename, const Material &m) : verts(), faces(), material(m) {
-    std::ifstream in;
-    in.open(filename, std::ifstream::in);
-    if (in.fail()) {
-        std::cerr << "Failed to open " << filename << std::endl;
+namespace {
+    const char cacheMagic[] = "SRTBVH";
+    // the key only covers the input file and the build options, so any change to what the parser or the builders
+    // make of the same input has to bump this, or old caches keep serving the old result
+    const uint32_t cacheVersion = 2;
+
+    enum CacheSection : uint32_t {
+        CacheVerts = 1, CacheFaces, CacheNodes, CacheRefs
+    };
+}
+
+// fills verts and faces arrays, polygons are triangulated and texture and normal indices are skipped,
+// parsed meshes and their bvh go to filename.bvhcache and are mapped back from there while the file stays the same;
+// binary meshes are mapped directly and only their bvh is cached
+Model::Model(const std::string &filename, const BVHOptions &o) : verts(), faces(), meshBounds(), options(o), bvh(),
+                                                                  wideBvh(), triangles() {
+    // leaves are always tested by triangles, so they are sized for its kernel whatever the caller asked for
+    options.leafWidth = Triangles::kernelWidth();
+    const std::string cacheFile = filename + ".bvhcache";
+    auto start = std::chrono::steady_clock::now();
+    uint64_t contentHash = 0;
+    const bool binary = read_mesh(filename, verts, faces, meshBounds, contentHash);
+    if (!binary) {
+        MappedFile file(filename);
+        if (file.valid())
+            contentHash = hash_bytes(file.data(), file.size());
+    }
+
+    const uint64_t key = contentHash ? cache_key(contentHash) : 0;
+    if (key && load_cache(cacheFile, key, !binary)) {
+        std::cout << "# v# " << verts.size() << " f# " << faces.size() << " bvh nodes# " << bvh.nnodes()
+                  << " from " << cacheFile << std::endl;
+        if (options.wide)
+            wideBvh.build(bvh);
+        buildTriangles();
         return;
     }
 
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line);
-        char trash;
-        if (!line.compare(0, 2, "v ")) {
-            iss >> trash;
-            Vec3f v;
-            for (int i = 0; i < 3; i++)
-                iss >> v[i];
-            verts.push_back(v);
-        } else if (!line.compare(0, 2, "f ")) {
-            Vec3i f;
-            int idx, cnt = 0;
-            iss >> trash;
-            while (iss >> idx) {
-                idx--; // in wavefront obj all indices start at 1, not zero
-                f[cnt++] = idx;
-            }
-            if (cnt == 3)
-                faces.push_back(f);
+    if (!binary) {
+        std::vector<Vec3f> v;
+        std::vector<Vec3i> f;
+        if (!parse_obj(filename, v, f)) {
+            std::cerr << "Failed to open " << filename << std::endl;
+            return;
         }
+        verts = Buffer<Vec3f>(std::move(v));
+        faces = Buffer<Vec3i>(std::move(f));
     }
-    std::cout << "# v# " << verts.size() << " f# " << faces.size() << std::endl;
+    const double loadTime =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "# v# " << verts.size() << " f# " << faces.size() << (binary ? " mapped in " : " parsed in ")
+              << loadTime << "ms" << std::endl;
+
+    buildBVH();
+    if (key && !faces.empty())
+        save_cache(cacheFile, key, !binary);
 
 //    Vec3f min, max;
 //    get_bbox(min, max);
@@ -72,6 +98,165 @@ bool Model::ray_triangle_intersect(const int &faceIdx, const Vec3f &origin, cons
     return false;
 }
 
+std::vector<AABB> Model::faceBounds() const {
+    std::vector<AABB> bounds(faces.size());
+    parallel_for(0, nfaces(), [&](const int i) {
+        for (int k = 0; k < 3; ++k)
+            bounds[i].grow(point(vert(i, k)));
+    });
+    return bounds;
+}
+
+// bounds of the parts of a face on both sides of an axis aligned plane, vertices on the plane go to both
+void Model::split_face(const int faceIdx, const int axis, const float position, AABB &left, AABB &right) const {
+    for (int k = 0; k < 3; ++k) {
+        const Vec3f &v0 = point(vert(faceIdx, k));
+        const Vec3f &v1 = point(vert(faceIdx, (k + 1) % 3));
+        if (v0[axis] <= position)
+            left.grow(v0);
+        if (v0[axis] >= position)
+            right.grow(v0);
+        if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position)) {
+            Vec3f onPlane = v0 + (v1 - v0) * ((position - v0[axis]) / (v1[axis] - v0[axis]));
+            left.grow(onPlane);
+            right.grow(onPlane);
+        }
+    }
+}
+
+void Model::buildBVH() {
+    using namespace std::placeholders;
+    bvh.build(faceBounds(), options, std::bind(&Model::split_face, this, _1, _2, _3, _4, _5));
+    std::cout << "# bvh nodes# " << bvh.nnodes() << " refs# " << bvh.nrefs() << " sah " << bvh.sahCost()
+              << " built in " << bvh.lastBuildTime() << "ms" << std::endl;
+    if (options.wide) {
+        wideBvh.build(bvh);
+        std::cout << "# bvh8 nodes# " << wideBvh.nnodes() << " " << BVH8::childTestName() << std::endl;
+    }
+    buildTriangles();
+    std::cout << "# triangles " << Triangles::kernelName() << " " << triangles.bytes() / 1024 << "KB, indexed "
+              << (verts.size() * sizeof(Vec3f) + faces.size() * sizeof(Vec3i)) / 1024 << "KB" << std::endl;
+}
+
+// every reference gets its own copy, spatial splits duplicate faces
+void Model::buildTriangles() {
+    const std::vector<int> &refs = bvh.getPrimIndices();
+    triangles.build(verts.data(), faces.data(), refs.data(), refs.size());
+}
+
+// the mesh file contents and everything that changes the tree
+uint64_t Model::cache_key(const uint64_t contentHash) const {
+    const int32_t builder = static_cast<int32_t>(options.builder);
+    uint64_t key = hash_bytes(&builder, sizeof(builder), contentHash);
+    key = hash_bytes(&options.splitBudget, sizeof(options.splitBudget), key);
+    key = hash_bytes(&options.leafWidth, sizeof(options.leafWidth), key);
+    const uint32_t layout[] = {sizeof(Vec3f), sizeof(Vec3i), sizeof(BVHNode)};
+    return hash_bytes(layout, sizeof(layout), key) | 1;
+}
+
+// a missing, stale or corrupt cache just fails to load and gets written again after the build.
+// only the mesh arrays are used straight from the mapping; the nodes and references are copied into the bvh,
+// and the triangle blocks and the eight wide tree are rebuilt from them, all linear passes far cheaper than a build.
+// the key still needs a hash of the whole obj file on every start, which costs about as much as reading it once
+bool Model::load_cache(const std::string &filename, const uint64_t key, const bool withMesh) {
+    BinaryReader reader;
+    if (!reader.open(filename, cacheMagic, cacheVersion, key, true, true))
+        return false;
+
+    uint64_t nn, nr;
+    const BVHNode *n = reader.section<BVHNode>(CacheNodes, nn);
+    const int *r = reader.section<int>(CacheRefs, nr);
+    if (!n || !r || !nn)
+        return false;
+    if (withMesh) {
+        uint64_t nv, nf;
+        const Vec3f *v = reader.section<Vec3f>(CacheVerts, nv);
+        const Vec3i *f = reader.section<Vec3i>(CacheFaces, nf);
+        if (!v || !f || !nf)
+            return false;
+        verts = Buffer<Vec3f>(reader.mapping(), v, nv);
+        faces = Buffer<Vec3i>(reader.mapping(), f, nf);
+    }
+
+    bvh.assign(n, nn, r, nr, options.leafWidth);
+    return true;
+}
+
+void Model::save_cache(const std::string &filename, const uint64_t key, const bool withMesh) const {
+    BinaryWriter writer;
+    if (withMesh) {
+        writer.add(CacheVerts, verts.data(), verts.size());
+        writer.add(CacheFaces, faces.data(), faces.size());
+    }
+    writer.add(CacheNodes, bvh.getNodes().data(), bvh.getNodes().size());
+    writer.add(CacheRefs, bvh.getPrimIndices().data(), bvh.getPrimIndices().size());
+    if (!writer.write(filename, cacheMagic, cacheVersion, key))
+        std::cerr << "Failed to write " << filename << std::endl;
+}
+
+void Model::refit() {
+    meshBounds = AABB(); // vertices moved, the stored box may not hold any more
+    bvh.refit(faceBounds());
+    // quantized boxes are relative to their parents, collapsing again is as cheap as refitting them
+    if (options.wide)
+        wideBvh.build(bvh);
+    buildTriangles();
+}
+
+float Model::bvhDegradation() const {
+    return bvh.degradation();
+}
+
+bool Model::ray_intersect(const Vec3f &origin, const Vec3f &dir, Hit &hit) const {
+    int ref = -1;
+    auto test = [&](const int first, const int count, float &t) {
+        const int i = triangles.intersect(first, count, origin, dir, t);
+        if (i < 0)
+            return false;
+        ref = i;
+        return true;
+    };
+    if (!(options.wide ? wideBvh.intersectLeaves(origin, dir, hit.t, test)
+                       : bvh.intersectLeaves(origin, dir, hit.t, test)))
+        return false;
+    hit.prim = bvh.getPrimIndices()[ref];
+    triangles.barycentrics(ref, origin, dir, hit.u, hit.v);
+    return true;
+}
+
+Vec3f Model::normal(const int face) const {
+    const Vec3f &v0 = point(vert(face, 0));
+    return cross(point(vert(face, 1)) - v0, point(vert(face, 2)) - v0);
+}
+
+bool Model::occluded(const Vec3f &origin, const Vec3f &dir, const float tmax) const {
+    auto test = [&](const int first, const int count) {
+        return triangles.occluded(first, count, origin, dir, tmax);
+    };
+    return options.wide ? wideBvh.occludedLeaves(origin, dir, tmax, test) : bvh.occludedLeaves(origin, dir, tmax, test);
+}
+
+uint64_t Model::intersectPacket(RayPacket &packet, const uint64_t active, Hit *hits) const {
+    int hitRef[RayPacket::maxSize];
+    uint64_t found = 0;
+    bvh.intersectPacket(packet, active, [&](const int first, const int count, uint64_t mask) {
+        for (; mask; mask &= mask - 1) {
+            const int r = __builtin_ctzll(mask);
+            const int i = triangles.intersect(first, count, packet.origin, packet.direction(r), packet.tnear[r]);
+            if (i >= 0) {
+                hitRef[r] = i;
+                found |= uint64_t(1) << r;
+            }
+        }
+    });
+    for (uint64_t mask = found; mask; mask &= mask - 1) {
+        const int r = __builtin_ctzll(mask);
+        hits[r].t = packet.tnear[r];
+        hits[r].prim = bvh.getPrimIndices()[hitRef[r]];
+        triangles.barycentrics(hitRef[r], packet.origin, packet.direction(r), hits[r].u, hits[r].v);
+    }
+    return found;
+}
 
 int Model::nverts() const {
     return static_cast<int>(verts.size());
@@ -81,12 +266,21 @@ int Model::nfaces() const {
     return static_cast<int>(faces.size());
 }
 
+AABB Model::bounds() const {
+    return bvh.empty() ? AABB() : bvh.bounds();
+}
+
 void Model::get_bbox(Vec3f &min, Vec3f &max) {
-    min = max = verts[0];
-    for (int i = 1; i < nverts(); ++i) {
-        for (int j = 0; j < 3; j++) {
-            min[j] = std::min(min[j], verts[i][j]);
-            max[j] = std::max(max[j], verts[i][j]);
+    if (!meshBounds.empty()) {
+        min = meshBounds.min;
+        max = meshBounds.max;
+    } else {
+        min = max = verts[0];
+        for (int i = 1; i < nverts(); ++i) {
+            for (int j = 0; j < 3; j++) {
+                min[j] = std::min(min[j], verts[i][j]);
+                max[j] = std::max(max[j], verts[i][j]);
+            }
         }
     }
     std::cout << "bbox: [" << min << " : " << max << "]" << std::endl;
@@ -120,7 +314,3 @@ std::ostream &operator<<(std::ostream &out, const Model &m) {
     }
     return out;
 }
-
-const Material &Model::getMaterial() const {
-    return material;
-}
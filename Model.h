@@ -7,24 +7,70 @@
 
 #include <ostream>
 #include "geometry.h"
-#include "Material.h"
+#include "Buffer.h"
+#include "BVH.h"
+#include "BVH8.h"
+#include "Triangles.h"
+#include "RayPacket.h"
+#include "Hit.h"
 
 class Model {
-    std::vector<Vec3f> verts;
-    std::vector<Vec3i> faces;
-    Material material;
-public:
-    Model(const std::string &filename, const Material &m);
+    Buffer<Vec3f> verts;
+    Buffer<Vec3i> faces;
+    AABB meshBounds; // stored in binary meshes, empty otherwise
+    BVHOptions options;
+    BVH bvh;
+    BVH8 wideBvh;
+    Triangles triangles; // faces in bvh order, what ray_intersect() actually tests
+
+    std::vector<AABB> faceBounds() const;
+
+    void buildTriangles();
+
+    void split_face(int faceIdx, int axis, float position, AABB &left, AABB &right) const;
 
-    const Material &getMaterial() const;
+    uint64_t cache_key(uint64_t contentHash) const;
+
+    bool load_cache(const std::string &filename, uint64_t key, bool withMesh);
+
+    void save_cache(const std::string &filename, uint64_t key, bool withMesh) const;
+
+public:
+    // takes a wavefront obj or a binary mesh written by obj2mesh, the latter is mapped without copying
+    explicit Model(const std::string &filename, const BVHOptions &o = BVHOptions());
 
     int nverts() const;
 
     int nfaces() const;
 
+    AABB bounds() const;
+
+    // full bvh build with the options the model was created with
+    void buildBVH();
+
+    // updates the bvh after vertices were moved through point(), much cheaper than buildBVH()
+    void refit();
+
+    // how much slower the bvh got since the last build, a rebuild usually pays off past 1.3-1.5
+    float bvhDegradation() const;
+
     bool ray_triangle_intersect(const int &faceIdx, const Vec3f &origin, const Vec3f &dir,
                                 float &tnear, Vec3f &N) const;
 
+    // closest hit over all faces closer than hit.t, walks the bvh instead of testing every face;
+    // records distance, face and barycentrics only, see normal()
+    bool ray_intersect(const Vec3f &origin, const Vec3f &dir, Hit &hit) const;
+
+    // unnormalized geometric normal of a face, cross(edge1, edge2)
+    Vec3f normal(int face) const;
+
+    // whether any face is hit closer than tmax, cheaper than ray_intersect() as it stops at the first one
+    bool occluded(const Vec3f &origin, const Vec3f &dir, float tmax) const;
+
+    // closest hits for the active rays of a packet, shrinks their tnear, fills hits of the rays that hit
+    // and returns their mask; always walks the binary bvh
+    uint64_t intersectPacket(RayPacket &packet, uint64_t active, Hit *hits) const;
+
     const Vec3f &point(int i) const;
 
     Vec3f &point(int i);
@@ -0,0 +1,252 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include "ObjParser.h"
+#include "MappedFile.h"
+#include "Parallel.h"
+
+namespace {
+    // smaller files are parsed on the calling thread
+    const size_t chunkGrain = 1 << 20;
+
+    const double powersOf10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    bool is_space(const char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    bool is_digit(const char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    const char *skip_spaces(const char *p, const char *end) {
+        while (p < end && is_space(*p))
+            ++p;
+        return p;
+    }
+
+    // up to 15 significant digits and powers of ten up to 22 are exact in a double, so one multiplication or
+    // division rounds the result correctly to a double. rounding that double to a float again can only go wrong
+    // when it landed exactly halfway between two floats, that case and everything else goes to strtof, so the
+    // result is always the correctly rounded float strtof gives; returns nullptr when there is no number
+    const char *parse_float(const char *p, const char *end, float &out) {
+        const char *start = p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+
+        uint64_t mantissa = 0;
+        int digits = 0, exponent = 0;
+        bool any = false;
+        for (; p < end && is_digit(*p); ++p, any = true) {
+            if (mantissa || *p != '0') {
+                if (++digits <= 15)
+                    mantissa = mantissa * 10 + (*p - '0');
+                else
+                    ++exponent;
+            }
+        }
+        if (p < end && *p == '.') {
+            for (++p; p < end && is_digit(*p); ++p, any = true) {
+                if (mantissa || *p != '0') {
+                    if (++digits <= 15) {
+                        mantissa = mantissa * 10 + (*p - '0');
+                        --exponent;
+                    }
+                } else {
+                    --exponent;
+                }
+            }
+        }
+        if (!any)
+            return nullptr;
+
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            bool negativeExp = false;
+            if (q < end && (*q == '-' || *q == '+'))
+                negativeExp = *q++ == '-';
+            if (q < end && is_digit(*q)) {
+                int e = 0;
+                for (; q < end && is_digit(*q); ++q)
+                    e = std::min(e * 10 + (*q - '0'), 100000);
+                exponent += negativeExp ? -e : e;
+                p = q;
+            }
+        }
+
+        if (digits > 15 || exponent < -22 || exponent > 22) {
+            std::string number(start, p);
+            out = std::strtof(number.c_str(), nullptr);
+            return p;
+        }
+        double value = static_cast<double>(mantissa);
+        value = exponent < 0 ? value / powersOf10[-exponent] : value * powersOf10[exponent];
+        // values here are normal floats, whose halfway points have only the top bit of the 29 bits a double has
+        // beyond a float's mantissa set
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        if ((bits & 0x1fffffff) == 0x10000000) {
+            std::string number(start, p);
+            out = std::strtof(number.c_str(), nullptr);
+            return p;
+        }
+        out = static_cast<float>(negative ? -value : value);
+        return p;
+    }
+
+    const char *parse_int(const char *p, const char *end, int &out) {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+        if (p >= end || !is_digit(*p))
+            return nullptr;
+        long value = 0;
+        for (; p < end && is_digit(*p); ++p)
+            value = std::min(value * 10 + (*p - '0'), 0x7fffffffL);
+        out = static_cast<int>(negative ? -value : value);
+        return p;
+    }
+
+    // calls index(i) for every vertex reference of a face line, v, v/vt, v//vn and v/vt/vn forms alike,
+    // and stops at the first token that does not start with a number
+    template<typename F>
+    int scan_face(const char *p, const char *end, F index) {
+        int cnt = 0, idx;
+        for (p = skip_spaces(p, end); (p = parse_int(p, end, idx)); p = skip_spaces(p, end)) {
+            while (p < end && !is_space(*p))
+                ++p;
+            index(idx);
+            ++cnt;
+        }
+        return cnt;
+    }
+
+    struct ChunkCounts {
+        size_t verts;
+        size_t faces;
+    };
+
+    // walks the lines starting inside [p, limit), the last one may run past it up to the end of the file
+    template<typename F>
+    void for_each_line(const char *p, const char *limit, const char *end, F line) {
+        while (p < limit) {
+            const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+            const char *lineEnd = eol ? eol : end;
+            if (lineEnd - p >= 2 && p[1] == ' ')
+                line(p, lineEnd);
+            p = lineEnd + 1;
+        }
+    }
+
+    ChunkCounts count_chunk(const char *p, const char *limit, const char *end) {
+        ChunkCounts counts = {0, 0};
+        for_each_line(p, limit, end, [&](const char *line, const char *lineEnd) {
+            if (line[0] == 'v') {
+                ++counts.verts;
+            } else if (line[0] == 'f') {
+                int n = scan_face(line + 2, lineEnd, [](int) {});
+                counts.faces += n > 2 ? n - 2 : 0;
+            }
+        });
+        return counts;
+    }
+
+    // writes the chunk straight to its place in the final arrays, polygons are split into fans around their
+    // first vertex and negative indices count back from the last vertex read before the face;
+    // triangles of polygons with indices out of range are marked with -1, returns how many polygons that hit
+    size_t parse_chunk(const char *p, const char *limit, const char *end, const size_t vertOffset, Vec3f *verts,
+                       Vec3i *faces, const int nverts) {
+        size_t nv = 0, nf = 0, broken = 0;
+        for_each_line(p, limit, end, [&](const char *line, const char *lineEnd) {
+            if (line[0] == 'v') {
+                Vec3f v;
+                const char *q = line + 2;
+                for (int i = 0; i < 3 && q; i++)
+                    q = parse_float(skip_spaces(q, lineEnd), lineEnd, v[i]);
+                verts[nv++] = v;
+            } else if (line[0] == 'f') {
+                const int before = static_cast<int>(vertOffset + nv);
+                int first = 0, prev = 0, k = 0;
+                bool valid = true;
+                const size_t firstFace = nf;
+                scan_face(line + 2, lineEnd, [&](const int idx) {
+                    // in wavefront obj all indices start at 1, not zero
+                    int v = idx < 0 ? before + idx : idx - 1;
+                    if (v < 0 || v >= nverts)
+                        valid = false;
+                    if (k == 0)
+                        first = v;
+                    else if (k >= 2)
+                        faces[nf++] = Vec3i(first, prev, v);
+                    prev = v;
+                    ++k;
+                });
+                if (!valid && nf > firstFace) {
+                    for (size_t i = firstFace; i < nf; ++i)
+                        faces[i] = Vec3i(-1, -1, -1);
+                    ++broken;
+                }
+            }
+        });
+        return broken;
+    }
+}
+
+bool parse_obj(const std::string &filename, std::vector<Vec3f> &verts, std::vector<Vec3i> &faces) {
+    verts.clear();
+    faces.clear();
+    MappedFile file(filename);
+    if (!file.valid())
+        return std::ifstream(filename).good(); // an empty file can not be mapped but is still a valid mesh
+
+    const char *data = file.data();
+    const size_t size = file.size();
+    const int chunkCount = static_cast<int>(std::max<size_t>(1, std::min<size_t>(worker_count(), size / chunkGrain)));
+
+    // a chunk takes the lines that start inside it, so it skips the tail of a line cut by its start
+    std::vector<size_t> begins(chunkCount), limits(chunkCount);
+    for (int c = 0; c < chunkCount; ++c) {
+        begins[c] = size / chunkCount * c;
+        limits[c] = c + 1 == chunkCount ? size : size / chunkCount * (c + 1);
+        while (begins[c] > 0 && begins[c] < limits[c] && data[begins[c] - 1] != '\n')
+            ++begins[c];
+    }
+
+    // the first pass only counts, so the second one knows where every chunk goes and what negative indices mean
+    std::vector<ChunkCounts> offsets(chunkCount + 1);
+    parallel_chunks(0, chunkCount, chunkCount, [&](const int c, int, int) {
+        offsets[c + 1] = count_chunk(data + begins[c], data + limits[c], data + size);
+    });
+    offsets[0].verts = offsets[0].faces = 0;
+    for (int c = 0; c < chunkCount; ++c) {
+        offsets[c + 1].verts += offsets[c].verts;
+        offsets[c + 1].faces += offsets[c].faces;
+    }
+
+    verts.resize(offsets[chunkCount].verts);
+    faces.resize(offsets[chunkCount].faces);
+    const int nverts = static_cast<int>(verts.size());
+    std::vector<size_t> broken(chunkCount);
+    parallel_chunks(0, chunkCount, chunkCount, [&](const int c, int, int) {
+        broken[c] = parse_chunk(data + begins[c], data + limits[c], data + size, offsets[c].verts,
+                                verts.data() + offsets[c].verts, faces.data() + offsets[c].faces, nverts);
+    });
+
+    // only files with bad indices pay for another pass
+    size_t brokenFaces = 0;
+    for (size_t b : broken)
+        brokenFaces += b;
+    if (brokenFaces) {
+        std::cerr << "Dropped " << brokenFaces << " faces with indices out of range in " << filename << std::endl;
+        faces.erase(std::remove_if(faces.begin(), faces.end(), [](const Vec3i &f) { return f.x < 0; }), faces.end());
+    }
+    return true;
+}
@@ -0,0 +1,16 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_OBJPARSER_H
+#define SIMPLERAYTRACER_OBJPARSER_H
+
+#include <string>
+#include <vector>
+#include "geometry.h"
+
+// reads "v " and "f " lines of a wavefront obj file into triangles, the file is mapped and cut into chunks at line
+// boundaries, every chunk is counted and then parsed on its own thread straight into the final arrays
+bool parse_obj(const std::string &filename, std::vector<Vec3f> &verts, std::vector<Vec3i> &faces);
+
+#endif //SIMPLERAYTRACER_OBJPARSER_H
@@ -0,0 +1,74 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include "Parallel.h"
+
+ThreadPool::ThreadPool() : workers(), tasks(), mutex(), wake(), stopping(false) {}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : workers)
+        t.join();
+}
+
+ThreadPool &ThreadPool::instance() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+        if (tasks.empty())
+            return;
+        std::function<void()> task = std::move(tasks.front());
+        tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+void ThreadPool::reserve(const int n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (static_cast<int>(workers.size()) < n)
+        workers.emplace_back(&ThreadPool::work, this);
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+}
+
+// under the lock, so a waiter can not miss the last task of its group between checking and sleeping
+void ThreadPool::finish(std::atomic<int> &pending) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.fetch_sub(1);
+    }
+    wake.notify_all();
+}
+
+void ThreadPool::wait(const std::atomic<int> &pending) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (pending.load()) {
+        if (tasks.empty()) {
+            wake.wait(lock);
+            continue;
+        }
+        std::function<void()> task = std::move(tasks.front());
+        tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
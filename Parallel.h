@@ -0,0 +1,197 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_PARALLEL_H
+#define SIMPLERAYTRACER_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline int worker_count() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? static_cast<int>(n) : 1;
+}
+
+// one set of worker threads for the whole process, started on first use and grown on demand, so rendering a band
+// or splitting a bvh node hands out tasks instead of starting and joining threads every time
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+
+    ThreadPool();
+
+    void work();
+
+public:
+    ~ThreadPool();
+
+    static ThreadPool &instance();
+
+    // makes sure at least n workers run, so n tasks and the calling thread can all be busy at once
+    void reserve(int n);
+
+    void submit(std::function<void()> task);
+
+    // marks one task of a group done, see TaskGroup
+    void finish(std::atomic<int> &pending);
+
+    // runs queued tasks, of any group, on the calling thread until pending drops to zero, so a task waiting
+    // for tasks it submitted itself never blocks the workers those need
+    void wait(const std::atomic<int> &pending);
+};
+
+// tasks submitted together and waited for together
+class TaskGroup {
+    std::atomic<int> pending;
+
+public:
+    TaskGroup() : pending(0) {}
+
+    ~TaskGroup() { wait(); }
+
+    template<typename F>
+    void run(F f) {
+        pending.fetch_add(1);
+        ThreadPool::instance().submit([this, f]() {
+            f();
+            ThreadPool::instance().finish(pending);
+        });
+    }
+
+    void wait() { ThreadPool::instance().wait(pending); }
+};
+
+// calls f(chunk, chunkBegin, chunkEnd) for every one of the chunks contiguous parts of [begin, end),
+// the parts go to the thread pool, which has a worker for each of them, and the calling thread takes the first one
+template<typename F>
+void parallel_chunks(const int begin, const int end, int chunks, F f) {
+    chunks = std::max(1, std::min(chunks, end - begin));
+    if (chunks == 1) {
+        f(0, begin, end);
+        return;
+    }
+
+    const int size = end - begin;
+    ThreadPool::instance().reserve(chunks - 1);
+    TaskGroup group;
+    for (int c = 1; c < chunks; ++c) {
+        const int b = begin + size / chunks * c + std::min(c, size % chunks);
+        const int e = begin + size / chunks * (c + 1) + std::min(c + 1, size % chunks);
+        group.run([&f, c, b, e]() { f(c, b, e); });
+    }
+    f(0, begin, begin + size / chunks + std::min(1, size % chunks));
+    group.wait();
+}
+
+// number of chunks worth splitting [begin, end) into when each of them should get at least grain items
+inline int chunk_count(const int begin, const int end, const int grain) {
+    return std::max(1, std::min(worker_count(), (end - begin) / std::max(1, grain)));
+}
+
+// calls f(i) for every i in [begin, end), ranges shorter than grain stay on the calling thread
+template<typename F>
+void parallel_for(const int begin, const int end, F f, const int grain = 1024) {
+    parallel_chunks(begin, end, chunk_count(begin, end, grain), [&f](int, const int b, const int e) {
+        for (int i = b; i < e; ++i)
+            f(i);
+    });
+}
+
+// the items [begin, end) a worker has left, packed into one word so that the owner taking from the front and
+// thieves taking the back half both get by with one compare-and-swap; the word is the whole state, so a range
+// coming back to the same value does no harm
+class StealRange {
+    std::atomic<uint64_t> range;
+
+    static uint64_t pack(const uint32_t begin, const uint32_t end) { return uint64_t(begin) << 32 | end; }
+
+public:
+    StealRange() : range(0) {}
+
+    // only for the owner and only while the range is empty, nobody steals from an empty range
+    void reset(const int begin, const int end) { range.store(pack(begin, end)); }
+
+    bool pop(int &item) {
+        uint64_t r = range.load();
+        for (;;) {
+            const uint32_t b = uint32_t(r >> 32), e = uint32_t(r);
+            if (b >= e)
+                return false;
+            if (range.compare_exchange_weak(r, pack(b + 1, e))) {
+                item = static_cast<int>(b);
+                return true;
+            }
+        }
+    }
+
+    // takes the back half, a single item as well
+    bool steal(int &begin, int &end) {
+        uint64_t r = range.load();
+        for (;;) {
+            const uint32_t b = uint32_t(r >> 32), e = uint32_t(r);
+            if (b >= e)
+                return false;
+            const uint32_t mid = b + (e - b) / 2;
+            if (range.compare_exchange_weak(r, pack(b, mid))) {
+                begin = static_cast<int>(mid);
+                end = static_cast<int>(e);
+                return true;
+            }
+        }
+    }
+};
+
+// threads parallel_tiles() actually runs on, no more than there are tiles
+inline int tile_threads(const int width, const int height, const int tile, const int threads) {
+    const int tiles = ((width + tile - 1) / tile) * ((height + tile - 1) / tile);
+    return std::max(1, std::min(threads, tiles));
+}
+
+// calls f(x0, y0, x1, y1) for every tile x tile square of a width x height frame on the given number of threads;
+// each thread starts on its own band of tiles and steals half of the tiles another thread has left once it runs out,
+// so expensive regions end up shared. returns the number of steals
+template<typename F>
+int parallel_tiles(const int width, const int height, const int tile, int threads, F f) {
+    const int tilesX = (width + tile - 1) / tile, tilesY = (height + tile - 1) / tile;
+    const int tiles = tilesX * tilesY;
+    threads = tile_threads(width, height, tile, threads);
+
+    std::vector<StealRange> ranges(threads);
+    for (int t = 0; t < threads; ++t)
+        ranges[t].reset(tiles / threads * t + std::min(t, tiles % threads),
+                        tiles / threads * (t + 1) + std::min(t + 1, tiles % threads));
+
+    std::atomic<int> steals(0);
+    parallel_chunks(0, threads, threads, [&](const int self, int, int) {
+        for (;;) {
+            int item;
+            while (ranges[self].pop(item)) {
+                const int x0 = item % tilesX * tile, y0 = item / tilesX * tile;
+                f(x0, y0, std::min(x0 + tile, width), std::min(y0 + tile, height));
+            }
+            // tiles are never added, so when every other range is empty the frame is done
+            int begin = 0, end = 0;
+            bool stolen = false;
+            for (int v = 1; v < threads && !stolen; ++v)
+                stolen = ranges[(self + v) % threads].steal(begin, end);
+            if (!stolen)
+                return;
+            ranges[self].reset(begin, end);
+            steals.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+    return steals.load();
+}
+
+#endif //SIMPLERAYTRACER_PARALLEL_H
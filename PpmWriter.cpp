@@ -0,0 +1,114 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <algorithm>
+#include <iostream>
+#include "PpmWriter.h"
+#include "Parallel.h"
+#include "Cpu.h"
+
+namespace {
+    void quantize_scalar(const Vec3f *pixels, const int n, uint8_t *bytes) {
+        for (int i = 0; i < n; ++i) {
+            Vec3f c = pixels[i];
+            float max = std::max(c[0], std::max(c[1], c[2]));
+            if (max > 1)
+                c = c * (1. / max);
+            for (int j = 0; j < 3; ++j)
+                bytes[3 * i + j] = static_cast<uint8_t>(static_cast<int>(255 * std::max(0.f, std::min(1.f, c[j]))));
+        }
+    }
+
+#ifdef SIMPLERAYTRACER_X86
+    // c * (1. / max) of the scalar code is computed in double and rounded back, so is the vector one;
+    // max and min take their operands in the order that keeps std::max and std::min nan handling
+    __attribute__((target("avx2")))
+    __m128 scale_down(const __m128 c, const __m128 max) {
+        const __m256d inverse = _mm256_div_pd(_mm256_set1_pd(1.), _mm256_cvtps_pd(max));
+        return _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_cvtps_pd(c), inverse));
+    }
+
+    __attribute__((target("avx2")))
+    __m256 scale_down(const __m256 c, const __m256 max) {
+        const __m128 lo = scale_down(_mm256_castps256_ps128(c), _mm256_castps256_ps128(max));
+        const __m128 hi = scale_down(_mm256_extractf128_ps(c, 1), _mm256_extractf128_ps(max, 1));
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    }
+
+    __attribute__((target("avx2")))
+    void quantize_avx2(const Vec3f *pixels, const int n, uint8_t *bytes) {
+        const float *p = &pixels[0][0];
+        const __m256i index = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+        const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f), scale = _mm256_set1_ps(255.f);
+        int i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 c[3];
+            for (int j = 0; j < 3; ++j)
+                c[j] = _mm256_i32gather_ps(p + 3 * i + j, index, 4);
+            const __m256 max = _mm256_max_ps(_mm256_max_ps(c[2], c[1]), c[0]);
+            const __m256 bright = _mm256_cmp_ps(max, one, _CMP_GT_OQ);
+            alignas(32) int32_t q[3][8];
+            for (int j = 0; j < 3; ++j) {
+                __m256 v = _mm256_blendv_ps(c[j], scale_down(c[j], max), bright);
+                v = _mm256_max_ps(_mm256_min_ps(v, one), zero);
+                _mm256_store_si256(reinterpret_cast<__m256i *>(q[j]), _mm256_cvttps_epi32(_mm256_mul_ps(v, scale)));
+            }
+            for (int k = 0; k < 8; ++k)
+                for (int j = 0; j < 3; ++j)
+                    bytes[3 * (i + k) + j] = static_cast<uint8_t>(q[j][k]);
+        }
+        quantize_scalar(pixels + i, n - i, bytes + 3 * i);
+    }
+#endif
+}
+
+QuantizeKernel quantize_kernel() {
+#ifdef SIMPLERAYTRACER_X86
+    if (cpu_supports_avx2())
+        return quantize_avx2;
+#endif
+    return quantize_scalar;
+}
+
+const char *quantize_kernel_name() {
+    return quantize_kernel() == quantize_scalar ? "scalar" : "avx2";
+}
+
+QuantizeKernel quantize_scalar_kernel() {
+    return quantize_scalar;
+}
+
+void quantize_pixels(const Vec3f *pixels, const int n, uint8_t *bytes) {
+    static const QuantizeKernel kernel = quantize_kernel();
+    kernel(pixels, n, bytes);
+}
+
+PpmWriter::PpmWriter(const std::string &filename, const int width, const int height) :
+        ofs(filename, std::ios::binary), w(width), h(height), rowsWritten(0), bytes() {
+    if (!ofs) {
+        std::cerr << "Error: can not write " << filename << std::endl;
+        return;
+    }
+    ofs << "P6\n" << w << ' ' << h << "\n255\n";
+}
+
+void PpmWriter::writeRows(const FrameBuffer &frame, int y0, int y1) {
+    y1 = std::min(y1, y0 + h - rowsWritten);
+    if (!ofs || y1 <= y0)
+        return;
+    const size_t rowBytes = 3 * static_cast<size_t>(w);
+    const int bandRows = static_cast<int>(std::max<size_t>(1, bandBytes / rowBytes));
+    const int tile = frame.tileSize();
+    for (int b0 = y0; b0 < y1; b0 += bandRows) {
+        const int b1 = std::min(b0 + bandRows, y1);
+        bytes.resize(rowBytes * (b1 - b0));
+        // rows are quantized straight from the tiles, one contiguous piece of a row per tile
+        parallel_for(b0, b1, [&](const int y) {
+            for (int x0 = 0; x0 < w; x0 += tile)
+                quantize_pixels(&frame.at(x0, y), std::min(tile, w - x0), bytes.data() + (y - b0) * rowBytes + 3 * x0);
+        }, std::max(1, 4096 / std::max(w, 1)));
+        ofs.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    }
+    rowsWritten += y1 - y0;
+}
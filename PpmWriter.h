@@ -0,0 +1,54 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_PPMWRITER_H
+#define SIMPLERAYTRACER_PPMWRITER_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "FrameBuffer.h"
+
+// 8 bit rgb of n colors: a color brighter than white is scaled down to it, then channels are clamped to [0, 1]
+// and truncated to 0..255
+void quantize_pixels(const Vec3f *pixels, int n, uint8_t *bytes);
+
+// binary ppm written in bands of rows: every band is quantized in parallel into one byte buffer and goes out
+// with a single write instead of a stream insertion per channel
+class PpmWriter {
+    std::ofstream ofs;
+    int w, h;
+    int rowsWritten;
+    std::vector<uint8_t> bytes;
+
+public:
+    // bytes of quantized rows buffered per write
+    static const size_t bandBytes = 16 << 20;
+
+    PpmWriter(const std::string &filename, int width, int height);
+
+    bool good() const { return ofs.good(); }
+
+    // appends rows [y0, y1) of the frame as the next rows of the image, so a frame holding only a band of the
+    // image can be written band after band; rows past the height of the image are dropped
+    void writeRows(const FrameBuffer &frame, int y0, int y1);
+
+    void write(const FrameBuffer &frame) { writeRows(frame, 0, frame.height()); }
+
+    int rows() const { return rowsWritten; }
+};
+
+typedef void (*QuantizeKernel)(const Vec3f *pixels, int n, uint8_t *bytes);
+
+// avx2 on eight pixels at once or scalar
+QuantizeKernel quantize_kernel();
+
+const char *quantize_kernel_name();
+
+// the plain loop quantize_kernel() falls back to, what the vector kernel has to match byte for byte
+QuantizeKernel quantize_scalar_kernel();
+
+#endif //SIMPLERAYTRACER_PPMWRITER_H
@@ -0,0 +1,104 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <cmath>
+#include "RayPacket.h"
+#include "Cpu.h"
+
+namespace {
+    typedef uint64_t (*BoxTest)(const RayPacket &packet, const AABB &box, uint64_t active);
+
+    uint64_t hit_mask_scalar(const RayPacket &packet, const AABB &box, uint64_t active) {
+        uint64_t mask = 0;
+        for (; active; active &= active - 1) {
+            const int r = __builtin_ctzll(active);
+            const Vec3f invDir(packet.invDir[0][r], packet.invDir[1][r], packet.invDir[2][r]);
+            float t;
+            if (box.ray_intersect(packet.origin, invDir, packet.tnear[r], t))
+                mask |= uint64_t(1) << r;
+        }
+        return mask;
+    }
+
+#ifdef SIMPLERAYTRACER_X86
+    // eight rays per step, groups without active rays are skipped; blends, max and min pick the same operands
+    // as the comparisons of the scalar slab test, nan included
+    __attribute__((target("avx2")))
+    uint64_t hit_mask_avx2(const RayPacket &packet, const AABB &box, const uint64_t active) {
+        __m256 lo[3], hi[3];
+        for (int k = 0; k < 3; ++k) {
+            lo[k] = _mm256_set1_ps(box.min[k] - packet.origin[k]);
+            hi[k] = _mm256_set1_ps(box.max[k] - packet.origin[k]);
+        }
+        uint64_t mask = 0;
+        for (int g = 0; g < packet.size; g += 8) {
+            const uint64_t groupActive = active >> g & 0xff;
+            if (!groupActive)
+                continue;
+            __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_loadu_ps(packet.tnear + g);
+            for (int k = 0; k < 3; ++k) {
+                const __m256 invDir = _mm256_loadu_ps(packet.invDir[k] + g);
+                const __m256 tmin = _mm256_mul_ps(lo[k], invDir);
+                const __m256 tmax = _mm256_mul_ps(hi[k], invDir);
+                const __m256 swap = _mm256_cmp_ps(tmin, tmax, _CMP_GT_OQ);
+                t0 = _mm256_max_ps(_mm256_blendv_ps(tmin, tmax, swap), t0);
+                t1 = _mm256_min_ps(_mm256_blendv_ps(tmax, tmin, swap), t1);
+            }
+            mask |= (groupActive & _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_NGT_UQ))) << g;
+        }
+        return mask;
+    }
+#endif
+
+    BoxTest box_test() {
+#ifdef SIMPLERAYTRACER_X86
+        if (cpu_supports_avx2())
+            return hit_mask_avx2;
+#endif
+        return hit_mask_scalar;
+    }
+}
+
+void RayPacket::prepare() {
+    coherent = size > 0;
+    meanDir = Vec3f(0, 0, 0);
+    for (int k = 0; k < 3; ++k) {
+        invMin[k] = std::numeric_limits<float>::max();
+        invMax[k] = -std::numeric_limits<float>::max();
+        for (int r = 0; r < size; ++r) {
+            invDir[k][r] = 1.f / dir[k][r];
+            invMin[k] = std::min(invMin[k], invDir[k][r]);
+            invMax[k] = std::max(invMax[k], invDir[k][r]);
+            meanDir[k] += dir[k][r];
+        }
+        // mixed signs, zeros or infinities make the intervals meaningless
+        if (!(invMin[k] > 0 || invMax[k] < 0) || !std::isfinite(invMin[k]) || !std::isfinite(invMax[k]))
+            coherent = false;
+        // the vector kernel always loads whole groups of eight
+        for (int r = size; r < (size + 7) / 8 * 8; ++r) {
+            invDir[k][r] = 0;
+            tnear[r] = 0;
+        }
+    }
+}
+
+// entry and exit distances are monotonic in the inverse direction, so the ends of the ranges bound them
+// for every ray: when the latest entry is past the earliest exit no ray gets inside
+bool RayPacket::frustumMisses(const AABB &box) const {
+    if (!coherent)
+        return false;
+    float entry = 0, exit = std::numeric_limits<float>::max();
+    for (int k = 0; k < 3; ++k) {
+        const float near = (invMin[k] > 0 ? box.min[k] : box.max[k]) - origin[k];
+        const float far = (invMin[k] > 0 ? box.max[k] : box.min[k]) - origin[k];
+        entry = std::max(entry, std::min(near * invMin[k], near * invMax[k]));
+        exit = std::min(exit, std::max(far * invMin[k], far * invMax[k]));
+    }
+    return entry > exit;
+}
+
+uint64_t RayPacket::hitMask(const AABB &box, const uint64_t active) const {
+    static const BoxTest test = box_test();
+    return test(*this, box, active);
+}
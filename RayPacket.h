@@ -0,0 +1,53 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_RAYPACKET_H
+#define SIMPLERAYTRACER_RAYPACKET_H
+
+#include <cstdint>
+#include "geometry.h"
+#include "BVH.h"
+
+// up to 64 rays leaving one point, e.g. the primary rays of an 8x8 pixel block, one array per component;
+// bit r of a ray mask stands for ray r
+struct RayPacket {
+    static const int maxSize = 64;
+
+    Vec3f origin;
+    int size;
+    alignas(32) float dir[3][maxSize];
+    alignas(32) float invDir[3][maxSize];
+    alignas(32) float tnear[maxSize]; // closest hit of every ray so far, boxes behind it are missed
+
+    // the frustum spanned by the packet as per axis ranges of inverse directions, only when every axis
+    // has the same direction sign for all rays
+    bool coherent;
+    float invMin[3], invMax[3];
+    Vec3f meanDir;
+
+    explicit RayPacket(const Vec3f &o) : origin(o), size(0), coherent(false), meanDir() {}
+
+    // returns the index of the ray
+    int add(const Vec3f &d, const float tmax) {
+        for (int k = 0; k < 3; ++k)
+            dir[k][size] = d[k];
+        tnear[size] = tmax;
+        return size++;
+    }
+
+    Vec3f direction(const int r) const { return Vec3f(dir[0][r], dir[1][r], dir[2][r]); }
+
+    uint64_t all() const { return size == maxSize ? ~uint64_t(0) : (uint64_t(1) << size) - 1; }
+
+    // computes inverse directions and the frustum, call it once all rays are added
+    void prepare();
+
+    // true when no ray of the packet can hit the box, one test for the whole packet
+    bool frustumMisses(const AABB &box) const;
+
+    // the active rays that hit the box before their tnear, the same test as AABB::ray_intersect()
+    uint64_t hitMask(const AABB &box, uint64_t active) const;
+};
+
+#endif //SIMPLERAYTRACER_RAYPACKET_H
@@ -0,0 +1,290 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include "BVH.h"
+
+namespace {
+    // spatial splits are only searched when the object split children overlap more than this part of the root
+    const float overlapThreshold = 1e-5f;
+
+    struct Reference {
+        int prim;
+        AABB bounds;
+    };
+
+    struct SpatialBin {
+        AABB bounds;
+        int enter; // references starting in the bin
+        int exit;  // references ending in the bin
+
+        SpatialBin() : bounds(), enter(0), exit(0) {}
+    };
+
+    struct Split {
+        float cost;
+        int axis;
+        int bin; // children are the bins before and after this one
+        AABB left, right;
+
+        Split() : cost(std::numeric_limits<float>::max()), axis(-1), bin(0), left(), right() {}
+    };
+
+    AABB overlap(const AABB &a, const AABB &b) {
+        AABB r;
+        for (size_t i = 3; i--;) {
+            r.min[i] = std::max(a.min[i], b.min[i]);
+            r.max[i] = std::min(a.max[i], b.max[i]);
+        }
+        return r;
+    }
+
+    int clamp_bin(const float x) {
+        return std::max(0, std::min(BVH::binCount - 1, static_cast<int>(x)));
+    }
+
+    // recursive builder of the spatial split bvh, every node owns the list of references it was given
+    class SpatialBuilder {
+        const BVH &tree; // only for the leaf costs, the nodes and references below are its own arrays
+        std::vector<BVHNode> &nodes;
+        std::vector<int> &primIndices;
+        const PrimSplitter &splitter;
+        const float rootArea;
+        int budget;
+
+        void splitReference(const Reference &ref, const int axis, const float position,
+                            Reference &left, Reference &right) const {
+            AABB l, r;
+            splitter(ref.prim, axis, position, l, r);
+            left.prim = right.prim = ref.prim;
+            left.bounds = overlap(l, ref.bounds);
+            right.bounds = overlap(r, ref.bounds);
+            left.bounds.max[axis] = std::min(left.bounds.max[axis], position);
+            right.bounds.min[axis] = std::max(right.bounds.min[axis], position);
+        }
+
+        Split findObjectSplit(const std::vector<Reference> &refs, const AABB &centroidBounds, const float nodeArea) const {
+            Split best;
+            for (int axis = 0; axis < 3; ++axis) {
+                const float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+                if (extent <= 0)
+                    continue;
+                const float scale = BVH::binCount / extent;
+
+                BVH::Bin bins[BVH::binCount];
+                for (const auto &ref : refs) {
+                    BVH::Bin &bin = bins[clamp_bin((ref.bounds.centroid()[axis] - centroidBounds.min[axis]) * scale)];
+                    bin.bounds.grow(ref.bounds);
+                    ++bin.count;
+                }
+                sweep(bins, axis, nodeArea, best);
+            }
+            return best;
+        }
+
+        Split findSpatialSplit(const std::vector<Reference> &refs, const AABB &bounds, const float nodeArea) const {
+            Split best;
+            for (int axis = 0; axis < 3; ++axis) {
+                const float extent = bounds.max[axis] - bounds.min[axis];
+                if (extent <= 0)
+                    continue;
+                const float width = extent / BVH::binCount;
+
+                // every reference is chopped at the bin planes it straddles and each piece grows its own bin
+                SpatialBin bins[BVH::binCount];
+                for (const auto &ref : refs) {
+                    const int first = clamp_bin((ref.bounds.min[axis] - bounds.min[axis]) / width);
+                    const int last = clamp_bin((ref.bounds.max[axis] - bounds.min[axis]) / width);
+                    ++bins[first].enter;
+                    ++bins[last].exit;
+                    Reference rest = ref;
+                    for (int b = first; b < last; ++b) {
+                        Reference piece, right;
+                        splitReference(rest, axis, bounds.min[axis] + width * (b + 1), piece, right);
+                        bins[b].bounds.grow(piece.bounds);
+                        rest = right;
+                    }
+                    bins[last].bounds.grow(rest.bounds);
+                }
+
+                AABB rightBounds[BVH::binCount];
+                AABB right;
+                for (int i = BVH::binCount - 1; i > 0; --i) {
+                    right.grow(bins[i].bounds);
+                    rightBounds[i] = right;
+                }
+                AABB left;
+                int leftCount = 0, rightCount = static_cast<int>(refs.size());
+                for (int i = 0; i < BVH::binCount - 1; ++i) {
+                    left.grow(bins[i].bounds);
+                    leftCount += bins[i].enter;
+                    rightCount -= bins[i].exit;
+                    if (!leftCount || !rightCount)
+                        continue;
+                    const float childCost = left.area() * tree.leafCost(leftCount) +
+                                            rightBounds[i + 1].area() * tree.leafCost(rightCount);
+                    float cost = BVH::traversalCost + childCost / nodeArea;
+                    if (cost < best.cost) {
+                        best.cost = cost;
+                        best.axis = axis;
+                        best.bin = i + 1;
+                        best.left = left;
+                        best.right = rightBounds[i + 1];
+                    }
+                }
+            }
+            return best;
+        }
+
+        void sweep(const BVH::Bin bins[], const int axis, const float nodeArea, Split &best) const {
+            AABB rightBounds[BVH::binCount];
+            int rightCount[BVH::binCount];
+            AABB right;
+            int rightSum = 0;
+            for (int i = BVH::binCount - 1; i > 0; --i) {
+                right.grow(bins[i].bounds);
+                rightSum += bins[i].count;
+                rightBounds[i] = right;
+                rightCount[i] = rightSum;
+            }
+            AABB left;
+            int leftSum = 0;
+            for (int i = 0; i < BVH::binCount - 1; ++i) {
+                left.grow(bins[i].bounds);
+                leftSum += bins[i].count;
+                if (!leftSum || !rightCount[i + 1])
+                    continue;
+                const float childCost = left.area() * tree.leafCost(leftSum) +
+                                        rightBounds[i + 1].area() * tree.leafCost(rightCount[i + 1]);
+                float cost = BVH::traversalCost + childCost / nodeArea;
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = i + 1;
+                    best.left = left;
+                    best.right = rightBounds[i + 1];
+                }
+            }
+        }
+
+        void makeLeaf(const int nodeIdx, const std::vector<Reference> &refs) {
+            nodes[nodeIdx].leftFirst = static_cast<int>(primIndices.size());
+            nodes[nodeIdx].count = static_cast<int>(refs.size());
+            for (const auto &ref : refs)
+                primIndices.push_back(ref.prim);
+        }
+
+    public:
+        SpatialBuilder(const BVH &t, std::vector<BVHNode> &n, std::vector<int> &p, const PrimSplitter &s,
+                       const float area, const int maxSplits) :
+                tree(t), nodes(n), primIndices(p), splitter(s), rootArea(area > 0 ? area : 1), budget(maxSplits) {}
+
+        void build(const int nodeIdx, std::vector<Reference> &refs, const int depth) {
+            AABB bounds, centroidBounds;
+            for (const auto &ref : refs) {
+                bounds.grow(ref.bounds);
+                centroidBounds.grow(ref.bounds.centroid());
+            }
+            nodes[nodeIdx].bounds = bounds;
+            const int count = static_cast<int>(refs.size());
+            if (count == 1 || depth >= BVH::maxDepth - 1) {
+                makeLeaf(nodeIdx, refs);
+                return;
+            }
+
+            const float nodeArea = bounds.area() > 0 ? bounds.area() : 1;
+            Split best = findObjectSplit(refs, centroidBounds, nodeArea);
+            bool spatial = false;
+            if (budget > 0 && (best.axis < 0 || overlap(best.left, best.right).area() / rootArea > overlapThreshold)) {
+                Split spatialSplit = findSpatialSplit(refs, bounds, nodeArea);
+                if (spatialSplit.cost < best.cost) {
+                    best = spatialSplit;
+                    spatial = true;
+                }
+            }
+
+            if (best.cost >= tree.leafCost(count) && count <= tree.leafLimit()) {
+                makeLeaf(nodeIdx, refs);
+                return;
+            }
+
+            std::vector<Reference> left, right;
+            if (best.axis < 0) {
+                // nothing separates the references, so just halve them
+                left.assign(refs.begin(), refs.begin() + count / 2);
+                right.assign(refs.begin() + count / 2, refs.end());
+            } else if (spatial) {
+                const int axis = best.axis;
+                const float width = (bounds.max[axis] - bounds.min[axis]) / BVH::binCount;
+                const float position = bounds.min[axis] + width * best.bin;
+                for (const auto &ref : refs) {
+                    if (clamp_bin((ref.bounds.max[axis] - bounds.min[axis]) / width) < best.bin) {
+                        left.push_back(ref);
+                    } else if (clamp_bin((ref.bounds.min[axis] - bounds.min[axis]) / width) >= best.bin) {
+                        right.push_back(ref);
+                    } else if (budget > 0) {
+                        // clipping to the reference may leave nothing on one side, whose box would then have
+                        // a made up centroid; only the pieces that are left get pushed and a lone one costs no split
+                        Reference l, r;
+                        splitReference(ref, axis, position, l, r);
+                        if (!l.bounds.empty() && !r.bounds.empty()) {
+                            left.push_back(l);
+                            right.push_back(r);
+                            --budget;
+                        } else if (!l.bounds.empty()) {
+                            left.push_back(l);
+                        } else if (!r.bounds.empty()) {
+                            right.push_back(r);
+                        } else {
+                            (ref.bounds.centroid()[axis] < position ? left : right).push_back(ref);
+                        }
+                    } else {
+                        // out of memory budget, the whole reference goes where its centroid is
+                        (ref.bounds.centroid()[axis] < position ? left : right).push_back(ref);
+                    }
+                }
+            } else {
+                const int axis = best.axis;
+                const float scale = BVH::binCount / (centroidBounds.max[axis] - centroidBounds.min[axis]);
+                for (const auto &ref : refs) {
+                    if (clamp_bin((ref.bounds.centroid()[axis] - centroidBounds.min[axis]) * scale) < best.bin)
+                        left.push_back(ref);
+                    else
+                        right.push_back(ref);
+                }
+            }
+            if (left.empty() || right.empty()) {
+                makeLeaf(nodeIdx, refs);
+                return;
+            }
+            std::vector<Reference>().swap(refs);
+
+            const int leftIdx = static_cast<int>(nodes.size());
+            nodes.emplace_back();
+            nodes.emplace_back();
+            nodes[nodeIdx].leftFirst = leftIdx;
+            nodes[nodeIdx].count = 0;
+            build(leftIdx, left, depth + 1);
+            build(leftIdx + 1, right, depth + 1);
+        }
+    };
+}
+
+// object splits as in the binned builder, plus splits that cut primitive references with a plane when the
+// children of the best object split overlap; every cut costs one reference out of n * splitBudget
+void BVH::buildSpatial(const std::vector<AABB> &primBounds, const PrimSplitter &splitter, const float splitBudget) {
+    const int n = static_cast<int>(primBounds.size());
+    std::vector<Reference> refs(n);
+    AABB bounds;
+    for (int i = 0; i < n; ++i) {
+        refs[i].prim = i;
+        refs[i].bounds = primBounds[i];
+        bounds.grow(primBounds[i]);
+    }
+
+    primIndices.clear();
+    primIndices.reserve(static_cast<size_t>(n * (1 + splitBudget)));
+    nodes.emplace_back();
+    SpatialBuilder builder(*this, nodes, primIndices, splitter, bounds.area(), static_cast<int>(n * splitBudget));
+    builder.build(0, refs, 0);
+}
@@ -0,0 +1,169 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <cmath>
+#include "Spheres.h"
+#include "Cpu.h"
+
+Spheres::Spheres() : centers(), radii(), materials(), data(), order(), stride(0), bvh() {}
+
+int Spheres::add(const Vec3f &center, const float radius, const MaterialId material) {
+    centers.push_back(center);
+    radii.push_back(radius);
+    materials.push_back(material);
+    return static_cast<int>(centers.size()) - 1;
+}
+
+void Spheres::build() {
+    const int n = size();
+    if (n >= bvhThreshold) {
+        std::vector<AABB> bounds(n);
+        for (int i = 0; i < n; ++i) {
+            const Vec3f r(radii[i], radii[i], radii[i]);
+            bounds[i] = AABB(centers[i] - r, centers[i] + r);
+        }
+        bvh.build(bounds, BVHOptions(BVHBuilder::BinnedSAH, false, 0, kernelWidth()));
+        order = bvh.getPrimIndices();
+    } else {
+        bvh = BVH();
+        order.resize(n);
+        for (int i = 0; i < n; ++i)
+            order[i] = i;
+    }
+
+    stride = (n + blockWidth - 1) / blockWidth * blockWidth + blockWidth;
+    data.assign(ComponentCount * stride, 0.f);
+    for (int i = 0; i < n; ++i) {
+        for (int k = 0; k < 3; ++k)
+            data[(Cx + k) * stride + i] = centers[order[i]][k];
+        data[Radius * stride + i] = radii[order[i]];
+    }
+}
+
+int Spheres::size() const {
+    return static_cast<int>(centers.size());
+}
+
+namespace {
+    // the original Sphere::ray_intersect: the far intersection counts when the origin is inside
+    int intersect_scalar(const Spheres &spheres, const int first, const int n, const Vec3f &origin,
+                         const Vec3f &dir, float &tnear) {
+        int hit = -1;
+        for (int i = first; i < first + n; ++i) {
+            const Vec3f center(spheres.component(Spheres::Cx)[i], spheres.component(Spheres::Cy)[i],
+                               spheres.component(Spheres::Cz)[i]);
+            const float radius = spheres.component(Spheres::Radius)[i];
+            Vec3f L = center - origin;
+            float tca = L * dir;
+            float d2 = L * L - tca * tca;
+            if (d2 > radius * radius)
+                continue;
+
+            float thc = sqrtf(radius * radius - d2);
+            float t0 = tca - thc;
+            float t1 = tca + thc;
+            if (t0 < 0)
+                t0 = t1;
+            if (t0 >= 0 && t0 < tnear) {
+                tnear = t0;
+                hit = i;
+            }
+        }
+        return hit;
+    }
+
+#ifdef SIMPLERAYTRACER_X86
+    // same operations in the same order as the scalar test, ties go to the first sphere
+    __attribute__((target("avx2")))
+    int intersect_avx2(const Spheres &spheres, const int first, const int n, const Vec3f &origin, const Vec3f &dir,
+                       float &tnear) {
+        const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+        const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+        const __m256 zero = _mm256_setzero_ps();
+        int hit = -1;
+        for (int b = first; b < first + n; b += 8) {
+            const __m256 lx = _mm256_sub_ps(_mm256_loadu_ps(spheres.component(Spheres::Cx) + b), ox);
+            const __m256 ly = _mm256_sub_ps(_mm256_loadu_ps(spheres.component(Spheres::Cy) + b), oy);
+            const __m256 lz = _mm256_sub_ps(_mm256_loadu_ps(spheres.component(Spheres::Cz) + b), oz);
+            const __m256 radius = _mm256_loadu_ps(spheres.component(Spheres::Radius) + b);
+            const __m256 r2 = _mm256_mul_ps(radius, radius);
+
+            const __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lz, dz), _mm256_mul_ps(ly, dy)),
+                                             _mm256_mul_ps(lx, dx));
+            const __m256 ll = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lz, lz), _mm256_mul_ps(ly, ly)),
+                                            _mm256_mul_ps(lx, lx));
+            const __m256 d2 = _mm256_sub_ps(ll, _mm256_mul_ps(tca, tca));
+            __m256 valid = _mm256_cmp_ps(d2, r2, _CMP_NGT_UQ);
+
+            const __m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(r2, d2));
+            const __m256 t0 = _mm256_sub_ps(tca, thc);
+            const __m256 t1 = _mm256_add_ps(tca, thc);
+            const __m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tnear), _CMP_LT_OQ));
+
+            const int lanes = first + n - b < 8 ? first + n - b : 8;
+            int mask = _mm256_movemask_ps(valid) & ((1 << lanes) - 1);
+            if (!mask)
+                continue;
+            alignas(32) float ts[8];
+            _mm256_store_ps(ts, t);
+            for (; mask; mask &= mask - 1) {
+                const int lane = __builtin_ctz(static_cast<unsigned>(mask));
+                if (ts[lane] < tnear) {
+                    tnear = ts[lane];
+                    hit = b + lane;
+                }
+            }
+        }
+        return hit;
+    }
+#endif
+}
+
+Spheres::Kernel Spheres::kernel() {
+#ifdef SIMPLERAYTRACER_X86
+    if (cpu_supports_avx2())
+        return intersect_avx2;
+#endif
+    return intersect_scalar;
+}
+
+const char *Spheres::kernelName() {
+    return kernel() == intersect_scalar ? "scalar" : "avx2";
+}
+
+int Spheres::kernelWidth() {
+    return kernel() == intersect_scalar ? 1 : blockWidth;
+}
+
+bool Spheres::ray_intersect(const Vec3f &origin, const Vec3f &dir, Hit &hit) const {
+    static const Kernel k = kernel();
+    int pos = -1;
+    if (bvh.empty()) {
+        pos = k(*this, 0, size(), origin, dir, hit.t);
+    } else {
+        bvh.intersectLeaves(origin, dir, hit.t, [&](const int first, const int count, float &t) {
+            const int i = k(*this, first, count, origin, dir, t);
+            if (i < 0)
+                return false;
+            pos = i;
+            return true;
+        });
+    }
+    if (pos < 0)
+        return false;
+    hit.prim = order[pos];
+    return true;
+}
+
+bool Spheres::occluded(const Vec3f &origin, const Vec3f &dir, float tmax) const {
+    static const Kernel k = kernel();
+    if (bvh.empty())
+        return k(*this, 0, size(), origin, dir, tmax) >= 0;
+    return bvh.occludedLeaves(origin, dir, tmax, [&](const int first, const int count) {
+        float t = tmax;
+        return k(*this, first, count, origin, dir, t) >= 0;
+    });
+}
@@ -0,0 +1,72 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_SPHERES_H
+#define SIMPLERAYTRACER_SPHERES_H
+
+#include <vector>
+#include "geometry.h"
+#include "Buffer.h"
+#include "Material.h"
+#include "BVH.h"
+#include "Hit.h"
+
+// all spheres of a scene: centers and radii in one aligned array per component, tested eight at a time,
+// with a bvh over them once there are enough to pay for it
+class Spheres {
+public:
+    enum Component {
+        Cx, Cy, Cz, Radius, ComponentCount
+    };
+
+    // below this many spheres testing all of them beats walking a tree
+    static const int bvhThreshold = 32;
+
+    static const int blockWidth = 8;
+
+private:
+    std::vector<Vec3f> centers; // in the order of add(), hits refer to these indices
+    std::vector<float> radii;
+    std::vector<MaterialId> materials;
+
+    std::vector<float, AlignedAllocator<float, 32>> data; // in bvh order, padded by a block like Triangles
+    std::vector<int> order; // index of the sphere at every position of data
+    size_t stride;
+    BVH bvh;
+
+public:
+    Spheres();
+
+    int add(const Vec3f &center, float radius, MaterialId material);
+
+    // lays the arrays out and builds the tree, call it after adding or moving spheres
+    void build();
+
+    int size() const;
+
+    const Vec3f &center(const int i) const { return centers[i]; }
+
+    MaterialId material(const int i) const { return materials[i]; }
+
+    const float *component(Component c) const { return data.data() + c * stride; }
+
+    // the closest sphere hit before hit.t, the distance is the first intersection in front of the origin
+    bool ray_intersect(const Vec3f &origin, const Vec3f &dir, Hit &hit) const;
+
+    bool occluded(const Vec3f &origin, const Vec3f &dir, float tmax) const;
+
+    // nearest hit before tnear among spheres [first, first + n) of the laid out arrays, returns its position or -1
+    typedef int (*Kernel)(const Spheres &spheres, int first, int n, const Vec3f &origin, const Vec3f &dir,
+                          float &tnear);
+
+    // avx2 on eight spheres at once or scalar
+    static Kernel kernel();
+
+    static const char *kernelName();
+
+    // spheres kernel() tests at once, the leaf width of the bvh
+    static int kernelWidth();
+};
+
+#endif //SIMPLERAYTRACER_SPHERES_H
@@ -0,0 +1,253 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include "Triangles.h"
+#include "Parallel.h"
+#include "Cpu.h"
+
+Triangles::Triangles() : data(), count(0), stride(0) {}
+
+void Triangles::build(const Vec3f *verts, const Vec3i *faces, const int *refs, const size_t refCount) {
+    count = refCount;
+    stride = (refCount + blockWidth - 1) / blockWidth * blockWidth + blockWidth;
+    data.assign(ComponentCount * stride, 0.f);
+
+    float *c[ComponentCount];
+    for (int k = 0; k < ComponentCount; ++k)
+        c[k] = data.data() + k * stride;
+    parallel_for(0, static_cast<int>(refCount), [&](const int i) {
+        const Vec3i &f = faces[refs[i]];
+        const Vec3f &v0 = verts[f[0]];
+        const Vec3f e1 = verts[f[1]] - v0;
+        const Vec3f e2 = verts[f[2]] - v0;
+        for (int k = 0; k < 3; ++k) {
+            c[V0x + k][i] = v0[k];
+            c[E1x + k][i] = e1[k];
+            c[E2x + k][i] = e2[k];
+        }
+    });
+}
+
+size_t Triangles::size() const {
+    return count;
+}
+
+size_t Triangles::bytes() const {
+    return data.size() * sizeof(float);
+}
+
+void Triangles::barycentrics(const int i, const Vec3f &origin, const Vec3f &dir, float &u, float &v) const {
+    const Vec3f pvec = cross(dir, e2(i));
+    const float invDet = 1.f / (e1(i) * pvec);
+    const Vec3f tvec = origin - v0(i);
+    u = tvec * pvec * invDet;
+    v = dir * cross(tvec, e1(i)) * invDet;
+}
+
+namespace {
+    // determinants below this are back faces or too close to parallel
+    const float minDet = 1e-5f;
+    const float minDist = 1e-5f;
+
+    int intersect_scalar(const Triangles &tris, const int first, const int n, const Vec3f &origin, const Vec3f &dir,
+                         float &tnear) {
+        int hit = -1;
+        for (int i = first; i < first + n; ++i) {
+            const Vec3f edge1 = tris.e1(i);
+            const Vec3f edge2 = tris.e2(i);
+            const Vec3f pvec = cross(dir, edge2);
+            const float det = edge1 * pvec;
+            if (det < minDet)
+                continue;
+
+            const Vec3f tvec = origin - tris.v0(i);
+            const float u = tvec * pvec;
+            if (u < 0 || u > det)
+                continue;
+
+            const Vec3f qvec = cross(tvec, edge1);
+            const float v = dir * qvec;
+            if (v < 0 || u + v > det)
+                continue;
+
+            const float t = edge2 * qvec * (1.f / det);
+            if (t > minDist && t < tnear) {
+                tnear = t;
+                hit = i;
+            }
+        }
+        return hit;
+    }
+}
+
+#ifdef SIMPLERAYTRACER_X86
+namespace {
+    // lanes that passed every test are few, the nearest one is picked in order so ties go to the first triangle
+    // just like in the scalar loop
+    int nearest_lane(int mask, const float *t, const int base, float &tnear, int hit) {
+        for (; mask; mask &= mask - 1) {
+            const int lane = __builtin_ctz(static_cast<unsigned>(mask));
+            if (t[lane] < tnear) {
+                tnear = t[lane];
+                hit = base + lane;
+            }
+        }
+        return hit;
+    }
+
+    // the branches of the scalar test become masks, products are summed in the order vec::operator* uses,
+    // so hits match the scalar kernel and distances differ at most by the rounding of contracted multiply-adds
+    __attribute__((target("avx2")))
+    int intersect_avx2(const Triangles &tris, const int first, const int n, const Vec3f &origin, const Vec3f &dir,
+                       float &tnear) {
+        const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+        const __m256 zero = _mm256_setzero_ps();
+        int hit = -1;
+        for (int b = first; b < first + n; b += 8) {
+            const __m256 e1x = _mm256_loadu_ps(tris.component(Triangles::E1x) + b);
+            const __m256 e1y = _mm256_loadu_ps(tris.component(Triangles::E1y) + b);
+            const __m256 e1z = _mm256_loadu_ps(tris.component(Triangles::E1z) + b);
+            const __m256 e2x = _mm256_loadu_ps(tris.component(Triangles::E2x) + b);
+            const __m256 e2y = _mm256_loadu_ps(tris.component(Triangles::E2y) + b);
+            const __m256 e2z = _mm256_loadu_ps(tris.component(Triangles::E2z) + b);
+
+            const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+            const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+            const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+            const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1z, pz), _mm256_mul_ps(e1y, py)),
+                                             _mm256_mul_ps(e1x, px));
+
+            const __m256 tx = _mm256_sub_ps(_mm256_set1_ps(origin.x),
+                                            _mm256_loadu_ps(tris.component(Triangles::V0x) + b));
+            const __m256 ty = _mm256_sub_ps(_mm256_set1_ps(origin.y),
+                                            _mm256_loadu_ps(tris.component(Triangles::V0y) + b));
+            const __m256 tz = _mm256_sub_ps(_mm256_set1_ps(origin.z),
+                                            _mm256_loadu_ps(tris.component(Triangles::V0z) + b));
+            const __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tz, pz), _mm256_mul_ps(ty, py)),
+                                           _mm256_mul_ps(tx, px));
+
+            const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+            const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+            const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+            const __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dz, qz), _mm256_mul_ps(dy, qy)),
+                                           _mm256_mul_ps(dx, qx));
+            const __m256 t = _mm256_mul_ps(
+                    _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2z, qz), _mm256_mul_ps(e2y, qy)),
+                                  _mm256_mul_ps(e2x, qx)),
+                    _mm256_div_ps(_mm256_set1_ps(1.f), det));
+
+            __m256 valid = _mm256_cmp_ps(det, _mm256_set1_ps(minDet), _CMP_NLT_UQ);
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_NLT_UQ));
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, det, _CMP_NGT_UQ));
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_NLT_UQ));
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), det, _CMP_NGT_UQ));
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(minDist), _CMP_GT_OQ));
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tnear), _CMP_LT_OQ));
+
+            const int lanes = first + n - b < 8 ? first + n - b : 8;
+            const int mask = _mm256_movemask_ps(valid) & ((1 << lanes) - 1);
+            if (mask) {
+                alignas(32) float ts[8];
+                _mm256_store_ps(ts, t);
+                hit = nearest_lane(mask, ts, b, tnear, hit);
+            }
+        }
+        return hit;
+    }
+
+    // leaves of up to eight triangles go to the avx2 kernel, which is faster on them
+    __attribute__((target("avx512f")))
+    int intersect_avx512(const Triangles &tris, const int first, const int n, const Vec3f &origin, const Vec3f &dir,
+                         float &tnear) {
+        if (n <= 8)
+            return intersect_avx2(tris, first, n, origin, dir, tnear);
+        const __m512 dx = _mm512_set1_ps(dir.x), dy = _mm512_set1_ps(dir.y), dz = _mm512_set1_ps(dir.z);
+        const __m512 zero = _mm512_setzero_ps();
+        int hit = -1;
+        for (int b = first; b < first + n; b += 16) {
+            const __m512 e1x = _mm512_loadu_ps(tris.component(Triangles::E1x) + b);
+            const __m512 e1y = _mm512_loadu_ps(tris.component(Triangles::E1y) + b);
+            const __m512 e1z = _mm512_loadu_ps(tris.component(Triangles::E1z) + b);
+            const __m512 e2x = _mm512_loadu_ps(tris.component(Triangles::E2x) + b);
+            const __m512 e2y = _mm512_loadu_ps(tris.component(Triangles::E2y) + b);
+            const __m512 e2z = _mm512_loadu_ps(tris.component(Triangles::E2z) + b);
+
+            const __m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+            const __m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+            const __m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+            const __m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1z, pz), _mm512_mul_ps(e1y, py)),
+                                             _mm512_mul_ps(e1x, px));
+
+            const __m512 tx = _mm512_sub_ps(_mm512_set1_ps(origin.x),
+                                            _mm512_loadu_ps(tris.component(Triangles::V0x) + b));
+            const __m512 ty = _mm512_sub_ps(_mm512_set1_ps(origin.y),
+                                            _mm512_loadu_ps(tris.component(Triangles::V0y) + b));
+            const __m512 tz = _mm512_sub_ps(_mm512_set1_ps(origin.z),
+                                            _mm512_loadu_ps(tris.component(Triangles::V0z) + b));
+            const __m512 u = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tz, pz), _mm512_mul_ps(ty, py)),
+                                           _mm512_mul_ps(tx, px));
+
+            const __m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e1z), _mm512_mul_ps(tz, e1y));
+            const __m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e1x), _mm512_mul_ps(tx, e1z));
+            const __m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e1y), _mm512_mul_ps(ty, e1x));
+            const __m512 v = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dz, qz), _mm512_mul_ps(dy, qy)),
+                                           _mm512_mul_ps(dx, qx));
+            const __m512 t = _mm512_mul_ps(
+                    _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2z, qz), _mm512_mul_ps(e2y, qy)),
+                                  _mm512_mul_ps(e2x, qx)),
+                    _mm512_div_ps(_mm512_set1_ps(1.f), det));
+
+            // masks chain through the compares, lanes past the leaf are never even compared
+            const int lanes = first + n - b < 16 ? first + n - b : 16;
+            __mmask16 valid = static_cast<__mmask16>((1u << lanes) - 1);
+            valid = _mm512_mask_cmp_ps_mask(valid, det, _mm512_set1_ps(minDet), _CMP_NLT_UQ);
+            valid = _mm512_mask_cmp_ps_mask(valid, u, zero, _CMP_NLT_UQ);
+            valid = _mm512_mask_cmp_ps_mask(valid, u, det, _CMP_NGT_UQ);
+            valid = _mm512_mask_cmp_ps_mask(valid, v, zero, _CMP_NLT_UQ);
+            valid = _mm512_mask_cmp_ps_mask(valid, _mm512_add_ps(u, v), det, _CMP_NGT_UQ);
+            valid = _mm512_mask_cmp_ps_mask(valid, t, _mm512_set1_ps(minDist), _CMP_GT_OQ);
+            valid = _mm512_mask_cmp_ps_mask(valid, t, _mm512_set1_ps(tnear), _CMP_LT_OQ);
+
+            if (valid) {
+                alignas(64) float ts[16];
+                _mm512_store_ps(ts, t);
+                hit = nearest_lane(valid, ts, b, tnear, hit);
+            }
+        }
+        return hit;
+    }
+}
+#endif
+
+Triangles::Kernel Triangles::kernel() {
+#ifdef SIMPLERAYTRACER_X86
+    if (cpu_supports_avx512())
+        return intersect_avx512;
+    if (cpu_supports_avx2())
+        return intersect_avx2;
+#endif
+    return intersect_scalar;
+}
+
+const char *Triangles::kernelName() {
+    Kernel k = kernel();
+#ifdef SIMPLERAYTRACER_X86
+    if (k == intersect_avx512)
+        return "avx512";
+    if (k == intersect_avx2)
+        return "avx2";
+#endif
+    return k == intersect_scalar ? "scalar" : "unknown";
+}
+
+int Triangles::kernelWidth() {
+#ifdef SIMPLERAYTRACER_X86
+    Kernel k = kernel();
+    if (k == intersect_avx512)
+        return 16;
+    if (k == intersect_avx2)
+        return 8;
+#endif
+    return 1;
+}
@@ -0,0 +1,78 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#ifndef SIMPLERAYTRACER_TRIANGLES_H
+#define SIMPLERAYTRACER_TRIANGLES_H
+
+#include <vector>
+#include "geometry.h"
+#include "Buffer.h"
+
+// triangles ready for intersection: the first vertex and both edges of every triangle, one array per component,
+// stored in bvh reference order so a leaf is a contiguous run of every array
+class Triangles {
+public:
+    enum Component {
+        V0x, V0y, V0z, E1x, E1y, E1z, E2x, E2y, E2z, ComponentCount
+    };
+
+    // widest simd block in floats, arrays start on its boundary and have one whole block of zeros after the end,
+    // so a block load at any triangle stays inside them
+    static const int blockWidth = 16;
+
+private:
+    std::vector<float, AlignedAllocator<float, blockWidth * sizeof(float)>> data;
+    size_t count;
+    size_t stride; // floats between two component arrays
+
+public:
+    Triangles();
+
+    // one triangle per reference, refs[i] is the face stored at position i
+    void build(const Vec3f *verts, const Vec3i *faces, const int *refs, size_t refCount);
+
+    size_t size() const;
+
+    // memory taken by the arrays including padding
+    size_t bytes() const;
+
+    const float *component(Component c) const { return data.data() + c * stride; }
+
+    Vec3f v0(const int i) const { return Vec3f(component(V0x)[i], component(V0y)[i], component(V0z)[i]); }
+
+    Vec3f e1(const int i) const { return Vec3f(component(E1x)[i], component(E1y)[i], component(E1z)[i]); }
+
+    Vec3f e2(const int i) const { return Vec3f(component(E2x)[i], component(E2y)[i], component(E2z)[i]); }
+
+    // unnormalized geometric normal, the same as cross(edge1, edge2) of the indexed faces
+    Vec3f normal(const int i) const { return cross(e1(i), e2(i)); }
+
+    // Moller and Trumbore over triangles [first, first + n), back faces are culled;
+    // returns the position of a hit closer than tnear and shrinks tnear to it, -1 when there is none
+    typedef int (*Kernel)(const Triangles &tris, int first, int n, const Vec3f &origin, const Vec3f &dir,
+                          float &tnear);
+
+    // the widest kernel the cpu supports: avx512 on 16 triangles at once, avx2 on 8 or scalar
+    static Kernel kernel();
+
+    static const char *kernelName();
+
+    // triangles kernel() tests at once, what bvh leaves over them are sized and costed by
+    static int kernelWidth();
+
+    int intersect(const int first, const int n, const Vec3f &origin, const Vec3f &dir, float &tnear) const {
+        static const Kernel k = kernel();
+        return k(*this, first, n, origin, dir, tnear);
+    }
+
+    // barycentric coordinates of the ray hit on triangle i, only worth it for the final hit
+    void barycentrics(int i, const Vec3f &origin, const Vec3f &dir, float &u, float &v) const;
+
+    // whether any of the triangles is hit before tmax, one kernel call as well
+    bool occluded(const int first, const int n, const Vec3f &origin, const Vec3f &dir, float tmax) const {
+        return intersect(first, n, origin, dir, tmax) >= 0;
+    }
+};
+
+#endif //SIMPLERAYTRACER_TRIANGLES_H
@@ -3,9 +3,18 @@
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <chrono>
+#include <mutex>
+#include <cstdlib>
+#include <string>
 
 #include "geometry.h"
 #include "Model.h"
+#include "Instance.h"
+#include "Spheres.h"
+#include "Parallel.h"
+#include "FrameBuffer.h"
+#include "PpmWriter.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 
@@ -18,27 +27,19 @@ struct Light {
     Light(const Vec3f &p, const float i) : position(p), intensity(i) {}
 };
 
-struct Sphere {
-    Vec3f center;
-    float radius;
-    Material material;
-
-    Sphere(const Vec3f &c, const float r, const Material &m) : center(c), radius(r), material(m) {}
-
-    bool ray_intersect(const Vec3f &origin, const Vec3f &dir, float &t0) const {
-        Vec3f L = center - origin;
-        float tca = L * dir;
-        float d2 = L * L - tca * tca;
-        if (d2 > radius * radius)
-            return false;
-
-        float thc = sqrtf(radius * radius - d2);
-        t0 = tca - thc;
-        float t1 = tca + thc;
-        if (t0 < 0)
-            t0 = t1;
-        return t0 >= 0;
-    }
+struct RenderOptions {
+    int width, height;
+    int threads;
+    int tileSize;   // side of the square tiles threads take and steal, rounded up to whole packets
+    int packetSide; // side of the pixel blocks traced as one packet, 4 or 8, or 0 to trace every pixel on its own
+    size_t memoryBudget; // bytes for the framebuffer, larger images are rendered and written a band of rows at a time
+    float minRayWeight;  // reflected and refracted rays adding less than this share of their color are not traced
+    bool wavefront;      // trace a tile breadth first, stage by stage, instead of every pixel depth first
+    bool sortRays;       // in wavefront mode, sort every wave of secondary rays by direction and origin first
+
+    RenderOptions() : width(1024 / 2), height(768 / 2), threads(worker_count()), tileSize(32), packetSide(8),
+                      memoryBudget(size_t(256) << 20), minRayWeight(1e-3f), wavefront(false),
+                      sortRays(false) {}
 };
 
 struct Envmap {
@@ -74,6 +75,9 @@ struct Envmap {
     }
 } envmap;
 
+MaterialTable materials;
+MaterialId checkerboardMaterials[2];
+
 Vec3f reflect(const Vec3f &I, const Vec3f &N) {
     return N * 2 * (I * N) - I;
 }
@@ -90,170 +94,650 @@ Vec3f refract(const Vec3f &I, const Vec3f &N, const float eta_t, const float eta
     return k < 0 ? Vec3f(1, 0, 0) : I * eta + N * (eta * cosi - sqrtf(k));
 }
 
-bool scene_intersect(const Vec3f &origin, const Vec3f &dir,
-                     const std::vector<Sphere> &spheres,
-                     const std::vector<Model> &models,
-                     Vec3f &hit, Vec3f &N, Material &material) {
-    float spheresDist = std::numeric_limits<float>::max();
-    for (const auto &sphere : spheres) {
-        float distI;
-        if (sphere.ray_intersect(origin, dir, distI) && distI < spheresDist) {
-            spheresDist = distI;
-            hit = origin + dir * distI;
-            N = (hit - sphere.center).normalize();
-            material = sphere.material;
-        }
-    }
+// which kind of object a scene hit is on, models keep their instance and face in the Hit itself
+enum class HitObject {
+    None, Sphere, Checkerboard, Model
+};
+
+struct SceneHit {
+    HitObject object;
+    Hit hit;
+
+    SceneHit() : object(HitObject::None), hit() {}
+};
+
+// spheres and the checkerboard closer than hit.t, only the distance and the object are recorded
+void objects_intersect(const Vec3f &origin, const Vec3f &dir,
+                       const Spheres &spheres,
+                       SceneHit &hit) {
+    if (spheres.ray_intersect(origin, dir, hit.hit))
+        hit.object = HitObject::Sphere;
 
-    float checkerboardDist = std::numeric_limits<float>::max();
     if (fabs(dir.y) > 1e-4) {
         float d = -(origin.y + 4) / dir.y;
         Vec3f pt = origin + dir * d;
-        if (d > 0 && d < spheresDist &&
+        if (d > 0 && d < hit.hit.t &&
             fabs(pt.x) < 10 && pt.z < -10 && pt.z > -30) {
-            checkerboardDist = d;
-            hit = pt;
-            N = Vec3f(0, 1, 0);
-            material.diffuseColor = (int(.5 * hit.x + 1000) + int(.5 * hit.z)) % 2 ?
-                                    Vec3f(.3, .3, .3) :
-                                    Vec3f(.3, .2, .1);
+            hit.hit.t = d;
+            hit.hit.prim = 0;
+            hit.object = HitObject::Checkerboard;
         }
     }
+}
 
-    float modelsDist = std::numeric_limits<float>::max();
-    for (const auto &model : models) {
-        for (int faceIdx = 0; faceIdx < model.nfaces(); ++faceIdx) {
-            float faceDist;
-            if (model.ray_triangle_intersect(faceIdx, origin, dir, faceDist, N) && faceDist < modelsDist) {
-                modelsDist = faceDist;
-                hit = origin + dir * faceDist;
-                material = model.getMaterial();
-            }
-        }
+bool scene_intersect(const Vec3f &origin, const Vec3f &dir,
+                     const Spheres &spheres,
+                     const TLAS &models,
+                     SceneHit &hit) {
+    objects_intersect(origin, dir, spheres, hit);
+    if (models.ray_intersect(origin, dir, hit.hit))
+        hit.object = HitObject::Model;
+
+    return hit.object != HitObject::None && hit.hit.t < 1000;
+}
+
+// hit point, normal and material of the final hit, the only place where they are computed
+void surface(const Vec3f &origin, const Vec3f &dir, const SceneHit &hit,
+             const Spheres &spheres,
+             const TLAS &models,
+             Vec3f &point, Vec3f &N, MaterialId &material) {
+    point = origin + dir * hit.hit.t;
+    switch (hit.object) {
+        case HitObject::Sphere:
+            N = (point - spheres.center(hit.hit.prim)).normalize();
+            material = spheres.material(hit.hit.prim);
+            break;
+        case HitObject::Checkerboard:
+            N = Vec3f(0, 1, 0);
+            material = checkerboardMaterials[(int(.5 * point.x + 1000) + int(.5 * point.z)) % 2 ? 0 : 1];
+            break;
+        case HitObject::Model:
+            N = models.normal(hit.hit);
+            material = models.material(hit.hit);
+            break;
+        case HitObject::None:
+            break;
+    }
+}
+
+// shadow rays only need to know whether anything is in the way before maxDist, no hit data at all
+bool scene_occluded(const Vec3f &origin, const Vec3f &dir, const float maxDist,
+                    const Spheres &spheres,
+                    const TLAS &models) {
+    if (spheres.occluded(origin, dir, maxDist))
+        return true;
+
+    if (fabs(dir.y) > 1e-4) {
+        float d = -(origin.y + 4) / dir.y;
+        Vec3f pt = origin + dir * d;
+        if (d > 0 && d < maxDist && fabs(pt.x) < 10 && pt.z < -10 && pt.z > -30)
+            return true;
     }
 
-    return std::min(modelsDist, std::min(spheresDist, checkerboardDist)) < 1000;
+    return models.occluded(origin, dir, maxDist);
 }
 
-Vec3f cast_ray(const Vec3f &origin, const Vec3f &dir,
-               const std::vector<Sphere> &spheres,
-               const std::vector<Light> &lights,
-               const std::vector<Model> &models,
-               size_t depth = 0) {
-    Vec3f point, N;
-    Material material;
-    if (depth > 4 || !scene_intersect(origin, dir, spheres, models, point, N, material)) {
-        int a = static_cast<int>((atan2(dir.z, dir.x) / (2 * M_PI) + .5) * envmap.width);
-        int b = static_cast<int>(acos(dir.y) / M_PI * envmap.height);
-        return envmap.get(a, b);
+// a reflected or refracted ray still to be traced, its color adds to the pixel scaled by weight, the product
+// of the albedos along the way
+struct PathRay {
+    Vec3f origin, dir;
+    float weight;
+    int depth;
+};
+
+// rays that would add less than minWeight of their color are not traced
+inline bool worth_tracing(const PathRay &ray, const float minWeight) {
+    return ray.weight != 0 && ray.weight >= minWeight;
+}
+
+// pending rays of one pixel, traced depth first; every traced ray adds at most two at the next depth, so at most
+// one waiting sibling per depth plus the two newest are ever held
+class RayStack {
+public:
+    static const int maxDepth = 4; // rays deeper than this only look up the environment
+
+private:
+    PathRay rays[maxDepth + 3];
+    int size;
+    float minWeight;
+
+public:
+    explicit RayStack(const float w) : size(0), minWeight(w) {}
+
+    void push(const PathRay &ray) {
+        if (worth_tracing(ray, minWeight))
+            rays[size++] = ray;
     }
 
-    Vec3f reflection, refraction;
+    bool empty() const { return size == 0; }
+
+    PathRay pop() { return rays[--size]; }
+};
+
+Vec3f environment(const Vec3f &dir) {
+    int a = static_cast<int>((atan2(dir.z, dir.x) / (2 * M_PI) + .5) * envmap.width);
+    int b = static_cast<int>(acos(dir.y) / M_PI * envmap.height);
+    return envmap.get(a, b);
+}
+
+// the reflected and refracted rays leaving a hit of ray, returns how many were written to out
+int secondary_rays(const PathRay &ray, const Vec3f &point, const Vec3f &N, const Material &material, PathRay *out) {
+    int count = 0;
     if (material.albedo[2] != 0) {
-        Vec3f reflectDir = reflect(-dir, N).normalize();
+        Vec3f reflectDir = reflect(-ray.dir, N).normalize();
         Vec3f reflectOrigin = reflectDir * N < 0 ? point - N * 1e-4 : point + N * 1e-4;
-        Vec3f reflectColor = cast_ray(reflectOrigin, reflectDir, spheres, lights, models, depth + 1);
-        reflection = reflectColor * material.albedo[2];
+        out[count++] = {reflectOrigin, reflectDir, ray.weight * material.albedo[2], ray.depth + 1};
     }
     if (material.albedo[3] != 0) {
-        Vec3f refractDir = refract(dir, N, material.refractiveIndex).normalize();
+        Vec3f refractDir = refract(ray.dir, N, material.refractiveIndex).normalize();
         Vec3f refractOrigin = refractDir * N < 0 ? point - N * 1e-4 : point + N * 1e-4;
-        Vec3f refractColor = cast_ray(refractOrigin, refractDir, spheres, lights, models, depth + 1);
-        refraction = refractColor * material.albedo[3];
+        out[count++] = {refractOrigin, refractDir, ray.weight * material.albedo[3], ray.depth + 1};
     }
+    return count;
+}
+
+// the shadow ray from a hit point towards a light, starting off the surface
+void light_ray(const Light &light, const Vec3f &point, const Vec3f &N,
+               Vec3f &lightDir, float &lightDistance, Vec3f &shadowOrigin) {
+    lightDir = (light.position - point).normalize();
+    lightDistance = (light.position - point).norm();
+    shadowOrigin = lightDir * N < 0 ? point - N * 1e-4 : point + N * 1e-4;
+}
+
+// adds a light that reaches the hit point to its diffuse and specular sums
+void add_light(const Light &light, const Vec3f &lightDir, const Vec3f &N, const Vec3f &dir, const Material &material,
+               float &diffuseLightIntensity, float &specularLightIntensity) {
+    diffuseLightIntensity += light.intensity * std::max(0.f, lightDir * N);
+    specularLightIntensity +=
+            light.intensity * powf(std::max(0.f, reflect(lightDir, N) * -dir), material.specularExponent);
+}
+
+Vec3f local_color(const Material &material, const float diffuseLightIntensity, const float specularLightIntensity) {
+    return material.diffuseColor * diffuseLightIntensity * material.albedo[0] +
+           Vec3f(1, 1, 1) * specularLightIntensity * material.albedo[1];
+}
+
+// light reaching a hit point directly, or the environment for a miss; reflected and refracted rays go on the stack
+// instead of being traced here
+Vec3f shade(const bool found,
+            const Vec3f &point, const Vec3f &N, const MaterialId materialId,
+            const Spheres &spheres,
+            const std::vector<Light> &lights,
+            const TLAS &models,
+            const PathRay &ray, RayStack &stack) {
+    if (!found)
+        return environment(ray.dir);
+
+    const Material &material = materials[materialId];
+
+    PathRay secondary[2];
+    for (int i = 0, count = secondary_rays(ray, point, N, material, secondary); i < count; ++i)
+        stack.push(secondary[i]);
 
     float diffuseLightIntensity = 0;
     float specularLightIntensity = 0;
     for (const auto &light : lights) {
-        Vec3f lightDir = (light.position - point).normalize();
-        float lightDistance = (light.position - point).norm();
-
-        Vec3f shadowOrigin = lightDir * N < 0 ? point - N * 1e-4 : point + N * 1e-4;
-        Vec3f shadowPt, shadowN;
-        Material tmpMat;
-        if (scene_intersect(shadowOrigin, lightDir, spheres, models, shadowPt, shadowN, tmpMat) &&
-            (shadowPt - shadowOrigin).norm() < lightDistance)
+        Vec3f lightDir, shadowOrigin;
+        float lightDistance;
+        light_ray(light, point, N, lightDir, lightDistance, shadowOrigin);
+        if (scene_occluded(shadowOrigin, lightDir, lightDistance, spheres, models))
             continue;
-
-        diffuseLightIntensity += light.intensity * std::max(0.f, lightDir * N);
-        specularLightIntensity +=
-                light.intensity * powf(std::max(0.f, reflect(lightDir, N) * -dir), material.specularExponent);
+        add_light(light, lightDir, N, ray.dir, material, diffuseLightIntensity, specularLightIntensity);
     }
 
-    return material.diffuseColor * diffuseLightIntensity * material.albedo[0] +
-           Vec3f(1, 1, 1) * specularLightIntensity * material.albedo[1] +
-           reflection + refraction;
+    return local_color(material, diffuseLightIntensity, specularLightIntensity);
 }
 
-void render(const std::vector<Sphere> &spheres,
+// traces everything on the stack, the weighted sum of their colors
+Vec3f trace(RayStack &stack,
+            const Spheres &spheres,
             const std::vector<Light> &lights,
-            const std::vector<Model> &models) {
-    const int width = 1024 / 2;
-    const int height = 768 / 2;
-//    const int width = 1920 * 8;
-//    const int height = 1080 * 8;
+            const TLAS &models) {
+    Vec3f color(0, 0, 0);
+    while (!stack.empty()) {
+        const PathRay ray = stack.pop();
+        SceneHit hit;
+        Vec3f point, N;
+        MaterialId material = 0;
+        bool found = ray.depth <= RayStack::maxDepth && scene_intersect(ray.origin, ray.dir, spheres, models, hit);
+        if (found)
+            surface(ray.origin, ray.dir, hit, spheres, models, point, N, material);
+        color = color + shade(found, point, N, material, spheres, lights, models, ray, stack) * ray.weight;
+    }
+    return color;
+}
+
+Vec3f cast_ray(const Vec3f &origin, const Vec3f &dir,
+               const Spheres &spheres,
+               const std::vector<Light> &lights,
+               const TLAS &models,
+               const float minWeight) {
+    RayStack stack(minWeight);
+    stack.push({origin, dir, 1, 0});
+    return trace(stack, spheres, lights, models);
+}
+
+// scene_intersect() for a whole packet, the models are traversed once for all rays
+void intersect_packet(RayPacket &packet,
+                      const Spheres &spheres,
+                      const TLAS &models,
+                      SceneHit *hits) {
+    for (int r = 0; r < packet.size; ++r) {
+        objects_intersect(packet.origin, packet.direction(r), spheres, hits[r]);
+        packet.tnear[r] = hits[r].hit.t;
+    }
+    packet.prepare();
+
+    // the models only look for hits closer than the spheres and the checkerboard
+    Hit modelHits[RayPacket::maxSize];
+    for (uint64_t hit = models.intersectPacket(packet, packet.all(), modelHits); hit; hit &= hit - 1) {
+        const int r = __builtin_ctzll(hit);
+        hits[r].hit = modelHits[r];
+        hits[r].object = HitObject::Model;
+    }
+}
+
+void cast_packet(RayPacket &packet,
+                 const Spheres &spheres,
+                 const std::vector<Light> &lights,
+                 const TLAS &models,
+                 const float minWeight,
+                 Vec3f *colors) {
+    SceneHit hits[RayPacket::maxSize];
+    intersect_packet(packet, spheres, models, hits);
+    for (int r = 0; r < packet.size; ++r) {
+        const PathRay primary = {packet.origin, packet.direction(r), 1, 0};
+        Vec3f point, N;
+        MaterialId material = 0;
+        const bool found = hits[r].object != HitObject::None && hits[r].hit.t < 1000;
+        if (found)
+            surface(packet.origin, primary.dir, hits[r], spheres, models, point, N, material);
+        RayStack stack(minWeight);
+        const Vec3f local = shade(found, point, N, material, spheres, lights, models, primary, stack);
+        colors[r] = local + trace(stack, spheres, lights, models);
+    }
+}
+
+// one generation of rays in the wavefront, with the pixel each of them adds its color to
+struct Wave {
+    std::vector<PathRay> rays;
+    std::vector<int> pixels;
+    std::vector<SceneHit> hits;
+
+    void add(const PathRay &ray, const int pixel) {
+        rays.push_back(ray);
+        pixels.push_back(pixel);
+    }
+
+    void clear() {
+        rays.clear();
+        pixels.clear();
+        hits.clear();
+    }
+};
+
+// a hit of the wave waiting for the results of its shadow rays
+struct ShadePoint {
+    Vec3f point, N, dir;
+    MaterialId material;
+    float weight;
+    int pixel;
+    float diffuseLightIntensity, specularLightIntensity;
+};
+
+struct ShadowRay {
+    Vec3f origin, dir;
+    float maxDist;
+    int point, light;
+};
+
+// how well consecutive secondary rays of the wavefront fit together and how fast they are intersected
+struct WaveStats {
+    uint64_t rays = 0;          // secondary rays intersected
+    uint64_t pairs = 0;         // consecutive rays within a wave, one less than its rays
+    uint64_t sameOctant = 0;    // of these pairs, how many go into the same octant
+    double originStep = 0;      // sum of the distances between the origins of the pairs
+    double intersectTime = 0;   // ms in the intersection stage of secondary waves, summed over the threads
+    double sortTime = 0;        // ms spent sorting them, summed the same way
+
+    void add(const WaveStats &other) {
+        rays += other.rays;
+        pairs += other.pairs;
+        sameOctant += other.sameOctant;
+        originStep += other.originStep;
+        intersectTime += other.intersectTime;
+        sortTime += other.sortTime;
+    }
+};
+
+inline int octant(const Vec3f &dir) {
+    return (dir.x < 0) | (dir.y < 0) << 1 | (dir.z < 0) << 2;
+}
+
+// adds the coherence of the rays in their current order to stats
+void measure_coherence(const std::vector<PathRay> &rays, WaveStats &stats) {
+    for (size_t i = 1; i < rays.size(); ++i) {
+        ++stats.pairs;
+        stats.sameOctant += octant(rays[i].dir) == octant(rays[i - 1].dir);
+        stats.originStep += (rays[i].origin - rays[i - 1].origin).norm();
+    }
+}
 
-    std::cout << width << 'x' << height << '=' << width * height << " pixels to render\n";
+// orders the rays of a wave by the octant of their direction first and the morton code of their origin within
+// the bounds of all origins second, so rays that run through the same part of the scene in the same direction
+// follow each other and find its bvh nodes still in the cache
+void sort_wave(Wave &wave) {
+    const size_t n = wave.rays.size();
+    AABB bounds;
+    for (const PathRay &ray : wave.rays)
+        bounds.grow(ray.origin);
+    const Vec3f extent = bounds.max - bounds.min;
+    Vec3f scale;
+    for (size_t k = 0; k < 3; ++k)
+        scale[k] = extent[k] > 0 ? 1 / extent[k] : 0;
+
+    std::vector<std::pair<uint64_t, int>> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+        const Vec3f p = wave.rays[i].origin - bounds.min;
+        const uint64_t code = morton_code(Vec3f(p.x * scale.x, p.y * scale.y, p.z * scale.z), 10);
+        keys[i] = std::make_pair(uint64_t(octant(wave.rays[i].dir)) << 30 | code, static_cast<int>(i));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<PathRay> rays(n);
+    std::vector<int> pixels(n);
+    for (size_t i = 0; i < n; ++i) {
+        rays[i] = wave.rays[keys[i].second];
+        pixels[i] = wave.pixels[keys[i].second];
+    }
+    wave.rays.swap(rays);
+    wave.pixels.swap(pixels);
+}
+
+// breadth first: the whole wave is intersected, then shaded, then its shadow rays are tested, and the reflected and
+// refracted rays it spawned become the next wave. every stage is one tight loop over a queue, so only its own code
+// and data are hot while it runs. the first wave can come with its hits already found, e.g. by packets when
+// intersected is set. colors[pixel] accumulates the weighted colors of all rays of a pixel, secondary waves are
+// sorted with sort_wave() when sortRays is set
+void trace_wave(Wave &wave, const bool intersected,
+                const Spheres &spheres,
+                const std::vector<Light> &lights,
+                const TLAS &models,
+                const float minWeight,
+                const bool sortRays,
+                WaveStats &stats,
+                Vec3f *colors) {
+    Wave next;
+    std::vector<ShadePoint> points;
+    std::vector<ShadowRay> shadows;
+    for (bool secondary = false; !wave.rays.empty(); secondary = true) {
+        const size_t n = wave.rays.size();
+        if (secondary) {
+            auto start = std::chrono::steady_clock::now();
+            if (sortRays)
+                sort_wave(wave);
+            auto sorted = std::chrono::steady_clock::now();
+            wave.hits.assign(n, SceneHit());
+            for (size_t i = 0; i < n; ++i)
+                if (wave.rays[i].depth <= RayStack::maxDepth)
+                    scene_intersect(wave.rays[i].origin, wave.rays[i].dir, spheres, models, wave.hits[i]);
+            auto end = std::chrono::steady_clock::now();
+            stats.rays += n;
+            stats.sortTime += std::chrono::duration<double, std::milli>(sorted - start).count();
+            stats.intersectTime += std::chrono::duration<double, std::milli>(end - sorted).count();
+            measure_coherence(wave.rays, stats);
+        } else if (!intersected) {
+            wave.hits.assign(n, SceneHit());
+            for (size_t i = 0; i < n; ++i)
+                scene_intersect(wave.rays[i].origin, wave.rays[i].dir, spheres, models, wave.hits[i]);
+        }
+
+        // misses take the environment, hits queue one shadow ray per light and spawn the next wave
+        points.clear();
+        shadows.clear();
+        next.clear();
+        for (size_t i = 0; i < n; ++i) {
+            const PathRay &ray = wave.rays[i];
+            const SceneHit &hit = wave.hits[i];
+            const int pixel = wave.pixels[i];
+            if (hit.object == HitObject::None || !(hit.hit.t < 1000)) {
+                colors[pixel] = colors[pixel] + environment(ray.dir) * ray.weight;
+                continue;
+            }
+            ShadePoint p;
+            surface(ray.origin, ray.dir, hit, spheres, models, p.point, p.N, p.material);
+            p.dir = ray.dir;
+            p.weight = ray.weight;
+            p.pixel = pixel;
+            p.diffuseLightIntensity = p.specularLightIntensity = 0;
+
+            PathRay secondary[2];
+            for (int s = 0, count = secondary_rays(ray, p.point, p.N, materials[p.material], secondary); s < count; ++s)
+                if (worth_tracing(secondary[s], minWeight))
+                    next.add(secondary[s], pixel);
+
+            for (size_t l = 0; l < lights.size(); ++l) {
+                ShadowRay shadow;
+                light_ray(lights[l], p.point, p.N, shadow.dir, shadow.maxDist, shadow.origin);
+                shadow.point = static_cast<int>(points.size());
+                shadow.light = static_cast<int>(l);
+                shadows.push_back(shadow);
+            }
+            points.push_back(p);
+        }
+
+        // the shadow rays of a point come in light order, so its sums add up exactly as in shade()
+        for (const ShadowRay &shadow : shadows) {
+            if (scene_occluded(shadow.origin, shadow.dir, shadow.maxDist, spheres, models))
+                continue;
+            ShadePoint &p = points[shadow.point];
+            add_light(lights[shadow.light], shadow.dir, p.N, p.dir, materials[p.material],
+                      p.diffuseLightIntensity, p.specularLightIntensity);
+        }
+
+        for (const ShadePoint &p : points) {
+            const Vec3f local = local_color(materials[p.material], p.diffuseLightIntensity, p.specularLightIntensity);
+            colors[p.pixel] = colors[p.pixel] + local * p.weight;
+        }
 
-    std::vector<Vec3f> frameBuffer(width * height);
-    std::cout << "Buffer created\n";
+        std::swap(wave, next);
+    }
+}
+
+void render(const Spheres &spheres,
+            const std::vector<Light> &lights,
+            const TLAS &models,
+            const RenderOptions &options) {
+    const int width = options.width;
+    const int height = options.height;
+
+    std::cout << width << 'x' << height << '=' << size_t(width) * height << " pixels to render\n";
+
+    const int packetSide = options.packetSide;
+    const int tileSize = packetSide ? (std::max(options.tileSize, 1) + packetSide - 1) / packetSide * packetSide
+                                    : std::max(options.tileSize, 1);
+    // whole rows of tiles that fit into the budget, at least one whatever the budget says
+    const size_t tileRowBytes = sizeof(Vec3f) * tileSize * tileSize * ((width + tileSize - 1) / tileSize);
+    const int bandRows = static_cast<int>(std::min(std::max<size_t>(1, options.memoryBudget / tileRowBytes),
+                                                   size_t(height + tileSize - 1) / tileSize)) * tileSize;
+    FrameBuffer frameBuffer(width, std::min(bandRows, height), tileSize);
+    std::cout << "Buffer created, " << bandRows << " rows per band\n";
 
     const float fovDeg = 60;
     const float fov = fovDeg * M_PI / 180;
     Vec3f center(0, 0, 0);
-
-#pragma omp parallel for
-    for (int i = 0; i < width; ++i) {
-        for (int j = 0; j < height; ++j) {
-            float dirX = (i + 0.5f) - width / 2.f;
-            float dirY = -(j + 0.5f) + height / 2.f;
-            float dirZ = -height / (2 * tanf(fov / 2));
-            Vec3f dir = Vec3f(dirX, dirY, dirZ).normalize();
-            frameBuffer[i + j * width] = cast_ray(center, dir, spheres, lights, models);
+    const float dirZ = -height / (2 * tanf(fov / 2));
+    auto primaryDir = [&](const int i, const int j) {
+        float dirX = (i + 0.5f) - width / 2.f;
+        float dirY = -(j + 0.5f) + height / 2.f;
+        return Vec3f(dirX, dirY, dirZ).normalize();
+    };
+
+    // pixels, or packets of them, follow the z curve through a tile, so consecutive rays stay close together
+    // and keep finding the same bvh nodes in the cache
+    int band = 0; // first image row of the band in the framebuffer
+    auto renderTile = [&](const int tx0, const int ty0, const int tx1, const int ty1) {
+        Vec3f *tile = frameBuffer.tileData(tx0, ty0);
+        if (!packetSide) {
+            for_each_morton(tx1 - tx0, ty1 - ty0, [&](const int x, const int y) {
+                tile[y * tileSize + x] = cast_ray(center, primaryDir(tx0 + x, band + ty0 + y), spheres, lights, models,
+                                                  options.minRayWeight);
+            });
+            return;
         }
-    }
-    std::cout << "Buffer filled\n";
-
-    std::ofstream ofs;
-    ofs.open("out.ppm", std::ios::binary);
-    ofs << "P6\n" << width << ' ' << height << "\n255\n";
-    for (int i = 0; i < height * width; ++i) {
-        Vec3f &c = frameBuffer[i];
-        float max = std::max(c[0], std::max(c[1], c[2]));
-        if (max > 1)
-            c = c * (1. / max);
-        for (int j = 0; j < 3; ++j) {
-            ofs << char(255 * std::max(0.f, std::min(1.f, frameBuffer[i][j])));
-//            ofs << char(255 * frameBuffer[i][j]);
+        const int blocksX = (tx1 - tx0 + packetSide - 1) / packetSide;
+        const int blocksY = (ty1 - ty0 + packetSide - 1) / packetSide;
+        for_each_morton(blocksX, blocksY, [&](const int bx, const int by) {
+            const int x0 = bx * packetSide, y0 = by * packetSide;
+            const int x1 = std::min(x0 + packetSide, tx1 - tx0), y1 = std::min(y0 + packetSide, ty1 - ty0);
+            RayPacket packet(center);
+            for (int y = y0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x)
+                    packet.add(primaryDir(tx0 + x, band + ty0 + y), std::numeric_limits<float>::max());
+
+            Vec3f colors[RayPacket::maxSize];
+            cast_packet(packet, spheres, lights, models, options.minRayWeight, colors);
+            for (int y = y0, r = 0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x)
+                    tile[y * tileSize + x] = colors[r++];
+        });
+    };
+
+    // the same pixels in the same order as the first wave of the wavefront, primary rays still go in packets
+    WaveStats waveStats;
+    std::mutex waveStatsMutex;
+    auto addStats = [&](const WaveStats &stats) {
+        std::lock_guard<std::mutex> lock(waveStatsMutex);
+        waveStats.add(stats);
+    };
+    auto renderTileWavefront = [&](const int tx0, const int ty0, const int tx1, const int ty1) {
+        Vec3f *tile = frameBuffer.tileData(tx0, ty0);
+        Wave wave;
+        WaveStats stats;
+        if (!packetSide) {
+            for_each_morton(tx1 - tx0, ty1 - ty0, [&](const int x, const int y) {
+                tile[y * tileSize + x] = Vec3f(0, 0, 0);
+                wave.add({center, primaryDir(tx0 + x, band + ty0 + y), 1, 0}, y * tileSize + x);
+            });
+            trace_wave(wave, false, spheres, lights, models, options.minRayWeight, options.sortRays, stats, tile);
+            addStats(stats);
+            return;
         }
+        const int blocksX = (tx1 - tx0 + packetSide - 1) / packetSide;
+        const int blocksY = (ty1 - ty0 + packetSide - 1) / packetSide;
+        for_each_morton(blocksX, blocksY, [&](const int bx, const int by) {
+            const int x0 = bx * packetSide, y0 = by * packetSide;
+            const int x1 = std::min(x0 + packetSide, tx1 - tx0), y1 = std::min(y0 + packetSide, ty1 - ty0);
+            RayPacket packet(center);
+            for (int y = y0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x)
+                    packet.add(primaryDir(tx0 + x, band + ty0 + y), std::numeric_limits<float>::max());
+
+            SceneHit hits[RayPacket::maxSize];
+            intersect_packet(packet, spheres, models, hits);
+            for (int y = y0, r = 0; y < y1; ++y) {
+                for (int x = x0; x < x1; ++x, ++r) {
+                    tile[y * tileSize + x] = Vec3f(0, 0, 0);
+                    wave.add({center, packet.direction(r), 1, 0}, y * tileSize + x);
+                    wave.hits.push_back(hits[r]);
+                }
+            }
+        });
+        trace_wave(wave, true, spheres, lights, models, options.minRayWeight, options.sortRays, stats, tile);
+        addStats(stats);
+    };
+
+    // finished bands go to the file right away, so memory stays at one band whatever the resolution
+    PpmWriter writer("out.ppm", width, height);
+    double renderTime = 0, writeTime = 0;
+    int steals = 0, threads = 1;
+    for (; band < height; band += bandRows) {
+        const int rows = std::min(bandRows, height - band);
+        threads = std::max(threads, tile_threads(width, rows, tileSize, options.threads));
+        auto start = std::chrono::steady_clock::now();
+        steals += options.wavefront ? parallel_tiles(width, rows, tileSize, options.threads, renderTileWavefront)
+                                    : parallel_tiles(width, rows, tileSize, options.threads, renderTile);
+        auto rendered = std::chrono::steady_clock::now();
+        writer.writeRows(frameBuffer, 0, rows);
+        renderTime += std::chrono::duration<double, std::milli>(rendered - start).count();
+        writeTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - rendered).count();
     }
-    ofs.close();
-    std::cout << "Image written\n";
+    std::cout << "Buffer filled in " << renderTime << "ms on " << threads << " threads, "
+              << tileSize << "px tiles, " << steals << " steals" << (options.wavefront ? ", wavefront" : "") << '\n';
+    if (options.wavefront && waveStats.pairs) {
+        std::cout << "# secondary rays " << waveStats.rays << (options.sortRays ? " sorted" : " unsorted")
+                  << ": same octant as the previous ray " << 100. * waveStats.sameOctant / waveStats.pairs
+                  << "%, mean origin step " << waveStats.originStep / waveStats.pairs
+                  << ", intersected at " << waveStats.rays / waveStats.intersectTime / 1000 << " Mrays/s per thread"
+                  << ", sorting took " << waveStats.sortTime << "ms of thread time" << std::endl;
+    }
+    std::cout << "Image written in " << writeTime << "ms, " << quantize_kernel_name() << " quantize\n";
 }
 
-int main() {
-    envmap.load("../data/envmap.jpg");
+// usage: simpleRayTracer [--width pixels] [--height pixels] [--threads n] [--tile pixels] [--packet side]
+//                        [--memory megabytes] [--min-weight weight] [--wavefront 0|1]
+//                        [--sort-rays 0|1]
+int main(int argc, char **argv) {
+    RenderOptions options;
+    for (int a = 1; a + 1 < argc; a += 2) {
+        const std::string arg = argv[a];
+        const int value = atoi(argv[a + 1]);
+        if (arg == "--width" && value > 0)
+            options.width = value;
+        else if (arg == "--height" && value > 0)
+            options.height = value;
+        else if (arg == "--memory" && value > 0)
+            options.memoryBudget = size_t(value) << 20;
+        else if (arg == "--threads" && value > 0)
+            options.threads = value;
+        else if (arg == "--tile" && value > 0)
+            options.tileSize = value;
+        else if (arg == "--packet" && (value == 0 || value == 4 || value == 8))
+            options.packetSide = value;
+        else if (arg == "--wavefront" && (value == 0 || value == 1))
+            options.wavefront = value != 0;
+        else if (arg == "--sort-rays" && (value == 0 || value == 1))
+            options.sortRays = value != 0;
+        else if (arg == "--min-weight" && atof(argv[a + 1]) >= 0)
+            options.minRayWeight = static_cast<float>(atof(argv[a + 1]));
+        else
+            std::cerr << "Warning: ignoring " << arg << ' ' << argv[a + 1] << std::endl;
+    }
+    if (argc % 2 == 0)
+        std::cerr << "Warning: ignoring " << argv[argc - 1] << ", it has no value" << std::endl;
+    if (options.sortRays && !options.wavefront) {
+        std::cerr << "Warning: ignoring --sort-rays, only waves of rays are sorted, see --wavefront" << std::endl;
+        options.sortRays = false;
+    }
 
-    Material ivory(1, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.4, 0.4, 0.3), 50);
-    Material glass(1.5, Vec4f(0.0, 0.5, 0.1, 0.8), Vec3f(0.6, 0.7, 0.8), 125);
-    Material redRubber(1, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.3, 0.1, 0.1), 10);
-    Material mirror(1, Vec4f(0.0, 10.0, 0.8, 0.0), Vec3f(1.0, 1.0, 1.0), 1425);
+    envmap.load("../data/envmap.jpg");
 
-    std::vector<Sphere> spheres;
-    spheres.emplace_back(Vec3f(-3, 0, -16), 2, ivory);
-    spheres.emplace_back(Vec3f(-1.0f, -1.5f, -12), 2, glass);
-    spheres.emplace_back(Vec3f(1.5, -0.5f, -18), 3, redRubber);
-    spheres.emplace_back(Vec3f(7, 5, -18), 4, mirror);
+    MaterialId ivory = materials.add(Material(1, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.4, 0.4, 0.3), 50));
+    MaterialId glass = materials.add(Material(1.5, Vec4f(0.0, 0.5, 0.1, 0.8), Vec3f(0.6, 0.7, 0.8), 125));
+    MaterialId redRubber = materials.add(Material(1, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.3, 0.1, 0.1), 10));
+    MaterialId mirror = materials.add(Material(1, Vec4f(0.0, 10.0, 0.8, 0.0), Vec3f(1.0, 1.0, 1.0), 1425));
+    checkerboardMaterials[0] = materials.add(Material(1, Vec4f(1, 0, 0, 0), Vec3f(.3, .3, .3), 0));
+    checkerboardMaterials[1] = materials.add(Material(1, Vec4f(1, 0, 0, 0), Vec3f(.3, .2, .1), 0));
+
+    Spheres spheres;
+    spheres.add(Vec3f(-3, 0, -16), 2, ivory);
+    spheres.add(Vec3f(-1.0f, -1.5f, -12), 2, glass);
+    spheres.add(Vec3f(1.5, -0.5f, -18), 3, redRubber);
+    spheres.add(Vec3f(7, 5, -18), 4, mirror);
+    spheres.build();
+    std::cout << "# spheres " << spheres.size() << ' ' << Spheres::kernelName() << std::endl;
 
     std::vector<Light> lights;
     lights.emplace_back(Vec3f(-20, 20, 20), 1.3);
     lights.emplace_back(Vec3f(30, 50, -25), 1.5);
     lights.emplace_back(Vec3f(30, 20, 30), 1.9);
 
-    std::vector<Model> models;
-    models.emplace_back("../data/duck.obj", glass);
+    TLAS models;
+    int duck = models.addMesh(Model("../data/duck.obj", BVHOptions(BVHBuilder::BinnedSAH, true)));
+    models.addInstance(duck, Transform(), glass);
+    models.build();
 
-    render(spheres, lights, models);
+    render(spheres, lights, models, options);
 
     return 0;
 }
\ No newline at end of file
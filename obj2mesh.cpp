@@ -0,0 +1,64 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "ObjParser.h"
+#include "MeshFile.h"
+
+// converts a wavefront obj to the binary mesh format Model maps without parsing,
+// usage: obj2mesh input.obj [output.mesh], the output defaults to the input with a .mesh extension;
+// obj2mesh --check file.mesh verifies the checksum and the indices of a mesh, which loading does not
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "usage: " << argv[0] << " input.obj [output.mesh]\n       " << argv[0] << " --check file.mesh"
+                  << std::endl;
+        return 1;
+    }
+    if (argc == 3 && std::string(argv[1]) == "--check") {
+        Buffer<Vec3f> verts;
+        Buffer<Vec3i> faces;
+        AABB bounds;
+        uint64_t checksum;
+        if (!read_mesh(argv[2], verts, faces, bounds, checksum, true)) {
+            std::cerr << argv[2] << " is not a valid mesh" << std::endl;
+            return 1;
+        }
+        std::cout << "# v# " << verts.size() << " f# " << faces.size() << " in " << argv[2] << " are valid" << std::endl;
+        return 0;
+    }
+    const std::string input = argv[1];
+    std::string output;
+    if (argc == 3) {
+        output = argv[2];
+    } else {
+        const size_t dot = input.find_last_of('.');
+        const size_t slash = input.find_last_of('/');
+        output = (dot != std::string::npos && (slash == std::string::npos || dot > slash) ? input.substr(0, dot)
+                                                                                           : input) + ".mesh";
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Vec3f> verts;
+    std::vector<Vec3i> faces;
+    if (!parse_obj(input, verts, faces)) {
+        std::cerr << "Failed to open " << input << std::endl;
+        return 1;
+    }
+
+    AABB bounds;
+    for (const Vec3f &v : verts)
+        bounds.grow(v);
+    if (!write_mesh(output, verts.data(), verts.size(), faces.data(), faces.size(), verts.empty() ? nullptr : &bounds)) {
+        std::cerr << "Failed to write " << output << std::endl;
+        return 1;
+    }
+
+    const double time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "# v# " << verts.size() << " f# " << faces.size() << " bbox: [" << bounds.min << " : "
+              << bounds.max << "] written to " << output << " in " << time << "ms" << std::endl;
+    return 0;
+}
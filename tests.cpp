@@ -0,0 +1,469 @@
+//
+// Created by ju5t on 17.10.26.
+//
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "Model.h"
+#include "Instance.h"
+#include "Spheres.h"
+#include "Material.h"
+#include "MeshFile.h"
+#include "ObjParser.h"
+#include "PpmWriter.h"
+
+// checks the fast paths against the plain code they replaced, run by ctest; exits with 1 when any check fails
+namespace {
+    int failures = 0;
+
+    void check(const bool ok, const std::string &what) {
+        if (!ok) {
+            std::cerr << "FAILED: " << what << std::endl;
+            ++failures;
+        }
+    }
+
+    void write_file(const std::string &filename, const std::string &contents) {
+        std::ofstream(filename, std::ios::binary) << contents;
+    }
+
+    bool same(const Vec3i &a, const Vec3i &b) {
+        return a.x == b.x && a.y == b.y && a.z == b.z;
+    }
+
+    // small triangles with some long slivers among them, so spatial splits have something to cut
+    void write_scene(const std::string &filename) {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> position(-20, 20), offset(-1, 1);
+        std::ofstream out(filename);
+        const int n = 2000;
+        for (int i = 0; i < n; ++i) {
+            Vec3f a(position(rng), position(rng), position(rng));
+            Vec3f b = a + Vec3f(offset(rng), offset(rng), offset(rng));
+            Vec3f c = a + Vec3f(offset(rng), offset(rng), offset(rng));
+            if (i % 10 == 0) {
+                b[i % 3] += 15;
+                c[i % 3] += 14;
+            }
+            out << "v " << a.x << ' ' << a.y << ' ' << a.z << "\nv " << b.x << ' ' << b.y << ' ' << b.z
+                << "\nv " << c.x << ' ' << c.y << ' ' << c.z << '\n';
+        }
+        for (int i = 0; i < n; ++i)
+            out << "f " << 3 * i + 1 << ' ' << 3 * i + 2 << ' ' << 3 * i + 3 << '\n';
+    }
+
+    // closest hit of the plain loop over every face, -1 when nothing is hit
+    int brute_force(const Model &model, const Vec3f &origin, const Vec3f &dir, float &tnear) {
+        int hit = -1;
+        tnear = std::numeric_limits<float>::max();
+        for (int f = 0; f < model.nfaces(); ++f) {
+            float t;
+            Vec3f N;
+            if (model.ray_triangle_intersect(f, origin, dir, t, N) && t < tnear) {
+                tnear = t;
+                hit = f;
+            }
+        }
+        return hit;
+    }
+
+    // a ray from somewhere around the scene towards a point inside it
+    void random_ray(std::mt19937 &rng, const float size, Vec3f &origin, Vec3f &dir) {
+        std::uniform_real_distribution<float> position(-size, size);
+        origin = Vec3f(position(rng), position(rng), position(rng));
+        dir = (Vec3f(position(rng), position(rng), position(rng)) * .5f - origin).normalize();
+    }
+
+    // closest hits and occlusion of the model against brute force, blockers just past the closest hit count
+    // and the closest hit itself is never in front of itself
+    void compare_model(const std::string &name, const Model &model, const unsigned seed) {
+        std::mt19937 rng(seed);
+        int hits = 0, wrongHits = 0, wrongOcclusion = 0;
+        for (int r = 0; r < 500; ++r) {
+            Vec3f origin, dir;
+            random_ray(rng, 30, origin, dir);
+            float t;
+            const int face = brute_force(model, origin, dir, t);
+            hits += face >= 0;
+            Hit hit;
+            const bool found = model.ray_intersect(origin, dir, hit);
+            if (found != (face >= 0) || (found && (hit.prim != face || hit.t != t)))
+                ++wrongHits;
+            if (face >= 0 && (!model.occluded(origin, dir, t * 1.01f) || model.occluded(origin, dir, t * .99f)))
+                ++wrongOcclusion;
+            if (face < 0 && model.occluded(origin, dir, std::numeric_limits<float>::max()))
+                ++wrongOcclusion;
+        }
+        check(hits > 100, name + ": only " + std::to_string(hits) + " rays hit anything");
+        check(wrongHits == 0, name + ": " + std::to_string(wrongHits) + " closest hits differ from brute force");
+        check(wrongOcclusion == 0, name + ": " + std::to_string(wrongOcclusion) + " occlusion queries wrong");
+    }
+
+    void test_bvh(const std::string &name, const BVHOptions &options) {
+        const std::string filename = "test_scene.obj";
+        write_scene(filename);
+        std::remove((filename + ".bvhcache").c_str());
+        const Model model(filename, options);
+        check(model.nfaces() == 2000, name + ": face count");
+        compare_model(name, model, 11);
+        std::remove((filename + ".bvhcache").c_str());
+        std::remove(filename.c_str());
+    }
+
+    // vertices moved through point() and a refit instead of a build still give the brute force hits
+    void test_refit(const std::string &name, const BVHOptions &options) {
+        const std::string filename = "test_scene.obj";
+        write_scene(filename);
+        std::remove((filename + ".bvhcache").c_str());
+        Model model(filename, options);
+        std::mt19937 rng(13);
+        std::uniform_real_distribution<float> offset(-2, 2);
+        for (int i = 0; i < model.nverts(); ++i) {
+            Vec3f &p = model.point(i);
+            p = Vec3f(p.x + .3f * p.y, p.y, p.z) + Vec3f(offset(rng), offset(rng), offset(rng));
+        }
+        model.refit();
+        check(model.bvhDegradation() > 0, name + ": degradation after refit");
+        compare_model(name, model, 17);
+        std::remove((filename + ".bvhcache").c_str());
+        std::remove(filename.c_str());
+    }
+
+    // the cache is written by the first load, serves the second and is ignored once the obj or the cache changes
+    void test_cache() {
+        const std::string filename = "test_cache.obj", cacheFile = filename + ".bvhcache";
+        write_scene(filename);
+        std::remove(cacheFile.c_str());
+        {
+            const Model built(filename);
+            check(std::ifstream(cacheFile).good(), "cache: written after the build");
+            const Model cached(filename);
+            check(cached.nfaces() == built.nfaces() && cached.nverts() == built.nverts(), "cache: mesh round trip");
+            compare_model("cache: loaded tree", cached, 19);
+        }
+        {
+            std::ofstream(filename, std::ios::app) << "v 100 0 0\nv 100 1 0\nv 100 0 1\nf -3 -2 -1\n";
+            const Model changed(filename);
+            check(changed.nfaces() == 2001, "cache: a changed obj is parsed again");
+            compare_model("cache: changed obj", changed, 23);
+        }
+        {
+            // flips a byte past the header, in the cached vertices
+            std::fstream cache(cacheFile, std::ios::in | std::ios::out | std::ios::binary);
+            cache.seekg(0, std::ios::end);
+            const std::streamoff size = cache.tellg();
+            cache.seekg(size / 4);
+            const char c = static_cast<char>(cache.get());
+            cache.seekp(size / 4);
+            cache.put(static_cast<char>(c ^ 0x40));
+        }
+        const Model corrupt(filename);
+        check(corrupt.nfaces() == 2001, "cache: a corrupt cache is rebuilt");
+        compare_model("cache: corrupt cache", corrupt, 29);
+        std::remove(cacheFile.c_str());
+        std::remove(filename.c_str());
+    }
+
+    void test_mesh_file() {
+        const std::string objFile = "test_mesh.obj", meshFile = "test_mesh.mesh";
+        write_scene(objFile);
+        std::vector<Vec3f> verts;
+        std::vector<Vec3i> faces;
+        check(parse_obj(objFile, verts, faces), "mesh: parse");
+        check(write_mesh(meshFile, verts.data(), verts.size(), faces.data(), faces.size(), nullptr), "mesh: write");
+
+        Buffer<Vec3f> mappedVerts;
+        Buffer<Vec3i> mappedFaces;
+        AABB bounds;
+        uint64_t checksum = 0;
+        check(read_mesh(meshFile, mappedVerts, mappedFaces, bounds, checksum, true), "mesh: verified read");
+        bool equal = mappedVerts.size() == verts.size() && mappedFaces.size() == faces.size();
+        for (size_t i = 0; equal && i < verts.size(); ++i)
+            equal = mappedVerts[i].x == verts[i].x && mappedVerts[i].y == verts[i].y && mappedVerts[i].z == verts[i].z;
+        for (size_t i = 0; equal && i < faces.size(); ++i)
+            equal = same(mappedFaces[i], faces[i]);
+        check(equal, "mesh: arrays round trip");
+        {
+            std::remove((meshFile + ".bvhcache").c_str());
+            const Model model(meshFile);
+            check(model.nfaces() == 2000, "mesh: model face count");
+            compare_model("mesh: mapped model", model, 31);
+        }
+
+        Vec3i bad[] = {Vec3i(0, 1, static_cast<int>(verts.size()))};
+        check(!write_mesh("test_bad.mesh", verts.data(), verts.size(), bad, 1, nullptr),
+              "mesh: faces out of range are not written");
+        std::remove("test_bad.mesh");
+        check(!read_mesh(objFile, mappedVerts, mappedFaces, bounds, checksum), "mesh: an obj is not a mesh");
+        {
+            std::fstream file(meshFile, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekg(0, std::ios::end);
+            const std::streamoff size = file.tellg();
+            file.seekp(size - 4);
+            file.put(7);
+        }
+        check(!read_mesh(meshFile, mappedVerts, mappedFaces, bounds, checksum, true),
+              "mesh: a corrupt body fails the verified read");
+        {
+            std::ifstream in(meshFile, std::ios::binary);
+            std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            write_file(meshFile, contents.substr(0, contents.size() / 2));
+        }
+        check(!read_mesh(meshFile, mappedVerts, mappedFaces, bounds, checksum),
+              "mesh: a truncated file fails even the cheap read");
+        std::remove((meshFile + ".bvhcache").c_str());
+        std::remove(meshFile.c_str());
+        std::remove(objFile.c_str());
+    }
+
+    // closest hit over every instance in its object space, the ray is not normalized there so t stays the same
+    int brute_force(const Model &mesh, const std::vector<Transform> &toWorld, const Vec3f &origin, const Vec3f &dir,
+                    float &tnear, int &face) {
+        int instance = -1;
+        tnear = std::numeric_limits<float>::max();
+        for (size_t i = 0; i < toWorld.size(); ++i) {
+            const Transform toObject = toWorld[i].inverse();
+            float t;
+            const int f = brute_force(mesh, toObject.point(origin), toObject.vector(dir), t);
+            if (f >= 0 && t < tnear) {
+                tnear = t;
+                face = f;
+                instance = static_cast<int>(i);
+            }
+        }
+        return instance;
+    }
+
+    // one mesh placed four times, single rays and packets through the tlas against brute force
+    void test_instances() {
+        const std::string filename = "test_instances.obj";
+        write_scene(filename);
+        std::remove((filename + ".bvhcache").c_str());
+        const Model mesh(filename);
+        const std::vector<Transform> toWorld = {
+                Transform(),
+                Transform::translation(Vec3f(50, 0, 0)) * Transform::rotationY(.7f),
+                Transform::translation(Vec3f(-50, 5, 0)) * Transform::scale(.5f),
+                Transform::rotationY(2) * Transform::translation(Vec3f(0, 0, 60)) * Transform::scale(1.5f)};
+        TLAS tlas;
+        tlas.addMesh(Model(filename));
+        for (const Transform &t : toWorld)
+            tlas.addInstance(0, t, 0);
+        tlas.build();
+
+        std::mt19937 rng(37);
+        int hits = 0, wrongHits = 0, wrongOcclusion = 0;
+        for (int r = 0; r < 200; ++r) {
+            Vec3f origin, dir;
+            random_ray(rng, 80, origin, dir);
+            float t;
+            int face = -1;
+            const int instance = brute_force(mesh, toWorld, origin, dir, t, face);
+            hits += instance >= 0;
+            Hit hit;
+            const bool found = tlas.ray_intersect(origin, dir, hit);
+            if (found != (instance >= 0) ||
+                (found && (hit.instance != instance || hit.prim != face || hit.t != t)))
+                ++wrongHits;
+            if (instance >= 0 && (!tlas.occluded(origin, dir, t * 1.01f) || tlas.occluded(origin, dir, t * .99f)))
+                ++wrongOcclusion;
+        }
+        check(hits > 40, "instances: only " + std::to_string(hits) + " rays hit anything");
+        check(wrongHits == 0, "instances: " + std::to_string(wrongHits) + " closest hits differ from brute force");
+        check(wrongOcclusion == 0, "instances: " + std::to_string(wrongOcclusion) + " occlusion queries wrong");
+
+        // narrow packets are coherent and take the frustum test, wide ones mix direction signs
+        int packetHits = 0, wrongPackets = 0;
+        std::uniform_real_distribution<float> unit(-1, 1);
+        for (int p = 0; p < 12; ++p) {
+            Vec3f origin, center;
+            random_ray(rng, 80, origin, center);
+            center = (toWorld[p % toWorld.size()].point(Vec3f(0, 0, 0)) - origin).normalize();
+            const float spread = p % 2 ? .02f : .5f;
+            RayPacket packet(origin);
+            for (int r = 0; r < RayPacket::maxSize; ++r)
+                packet.add((center + Vec3f(unit(rng), unit(rng), unit(rng)) * spread).normalize(),
+                           std::numeric_limits<float>::max());
+            packet.prepare();
+            Hit hits_[RayPacket::maxSize];
+            const uint64_t found = tlas.intersectPacket(packet, packet.all(), hits_);
+            for (int r = 0; r < packet.size; ++r) {
+                float t;
+                int face = -1;
+                const int instance = brute_force(mesh, toWorld, origin, packet.direction(r), t, face);
+                const bool hit = (found >> r & 1) != 0;
+                packetHits += hit;
+                if (hit != (instance >= 0) || (hit && (hits_[r].instance != instance ||
+                                                       hits_[r].prim != face || packet.tnear[r] != t)))
+                    ++wrongPackets;
+            }
+        }
+        check(packetHits > 100, "packets: only " + std::to_string(packetHits) + " rays hit anything");
+        check(wrongPackets == 0, "packets: " + std::to_string(wrongPackets) + " rays differ from brute force");
+        std::remove((filename + ".bvhcache").c_str());
+        std::remove(filename.c_str());
+    }
+
+    // the sphere test of the original renderer, the far intersection counts when the origin is inside
+    bool sphere_intersect(const Vec3f &center, const float radius, const Vec3f &origin, const Vec3f &dir, float &t) {
+        Vec3f L = center - origin;
+        float tca = L * dir;
+        float d2 = L * L - tca * tca;
+        if (d2 > radius * radius)
+            return false;
+        float thc = sqrtf(radius * radius - d2);
+        t = tca - thc;
+        if (t < 0)
+            t = tca + thc;
+        return t >= 0;
+    }
+
+    // below and above the count where spheres get a bvh
+    void test_spheres(const int count) {
+        const std::string name = "spheres " + std::to_string(count);
+        std::mt19937 rng(41);
+        std::uniform_real_distribution<float> position(-20, 20), size(.2f, 2);
+        Spheres spheres;
+        std::vector<Vec3f> centers;
+        std::vector<float> radii;
+        for (int i = 0; i < count; ++i) {
+            centers.push_back(Vec3f(position(rng), position(rng), position(rng)));
+            radii.push_back(size(rng));
+            spheres.add(centers.back(), radii.back(), 0);
+        }
+        spheres.build();
+
+        int hits = 0, wrongHits = 0, wrongOcclusion = 0;
+        for (int r = 0; r < 500; ++r) {
+            Vec3f origin, dir;
+            random_ray(rng, 30, origin, dir);
+            float best = std::numeric_limits<float>::max();
+            int sphere = -1;
+            for (int i = 0; i < count; ++i) {
+                float t;
+                if (sphere_intersect(centers[i], radii[i], origin, dir, t) && t < best) {
+                    best = t;
+                    sphere = i;
+                }
+            }
+            hits += sphere >= 0;
+            Hit hit;
+            const bool found = spheres.ray_intersect(origin, dir, hit);
+            if (found != (sphere >= 0) || (found && (hit.prim != sphere || hit.t != best)))
+                ++wrongHits;
+            if (sphere >= 0 && (!spheres.occluded(origin, dir, best * 1.01f) ||
+                                spheres.occluded(origin, dir, best * .99f)))
+                ++wrongOcclusion;
+        }
+        check(hits > 20, name + ": only " + std::to_string(hits) + " rays hit anything");
+        check(wrongHits == 0, name + ": " + std::to_string(wrongHits) + " closest hits differ from brute force");
+        check(wrongOcclusion == 0, name + ": " + std::to_string(wrongOcclusion) + " occlusion queries wrong");
+    }
+
+    void test_materials() {
+        MaterialTable table;
+        const MaterialId first = table.add(Material());
+        const MaterialId second = table.add(Material(1.5f, Vec4f(0, .5f, .1f, .8f), Vec3f(.6f, .7f, .8f), 125));
+        check(first == 0 && second == 1 && table.size() == 2, "materials: ids in the order of add()");
+        table[first].refractiveIndex = 2;
+        check(table[first].refractiveIndex == 2 && table[second].refractiveIndex == 1.5f,
+              "materials: editing an entry");
+        while (table.size() < MaterialTable::maxSize)
+            table.add(Material());
+        bool thrown = false;
+        try {
+            table.add(Material());
+        } catch (const std::length_error &) {
+            thrown = true;
+        }
+        check(thrown && table.size() == MaterialTable::maxSize, "materials: a full table throws");
+    }
+
+    void test_parse_obj() {
+        const std::string filename = "test_parse.obj";
+        std::vector<Vec3f> verts;
+        std::vector<Vec3i> faces;
+
+        write_file(filename, "v 1.5 -2 3e-1\nv 0 1 0\nv 0 0 1\nv 1 1 1\nf 1 2 3 4\n");
+        check(parse_obj(filename, verts, faces), "quad: parse");
+        check(verts.size() == 4 && verts[0].x == 1.5f && verts[0].y == -2.f && verts[0].z == .3f, "quad: vertices");
+        check(faces.size() == 2 && same(faces[0], Vec3i(0, 1, 2)) && same(faces[1], Vec3i(0, 2, 3)),
+              "quad: split into a fan around the first vertex");
+
+        write_file(filename, "v 0 0 0\nv 1 0 0\nv 0 1 0\nvt 0 0\nvn 0 0 1\n"
+                             "f 1/1 2/1 3/1\nf 1//1 2//1 3//1\r\nf 1/1/1 2/1/1 3/1/1\n");
+        check(parse_obj(filename, verts, faces), "slashes: parse");
+        check(verts.size() == 3 && faces.size() == 3, "slashes: counts, vt and vn lines are not vertices");
+        for (const Vec3i &f : faces)
+            check(same(f, Vec3i(0, 1, 2)), "slashes: texture and normal indices are skipped");
+
+        write_file(filename, "v 0 0 0\nv 1 0 0\nv 0 1 0\nf -3 -2 -1\nv 1 1 0\nf -4 -2/1 -1//1\n");
+        check(parse_obj(filename, verts, faces), "negative: parse");
+        check(faces.size() == 2 && same(faces[0], Vec3i(0, 1, 2)) && same(faces[1], Vec3i(0, 2, 3)),
+              "negative: indices count back from the last vertex before the face");
+
+        write_file(filename, "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 9\nf 0 1 2\nf 1 2 3\n");
+        check(parse_obj(filename, verts, faces), "out of range: parse");
+        check(faces.size() == 1 && same(faces[0], Vec3i(0, 1, 2)), "out of range: faces dropped");
+
+        std::remove(filename.c_str());
+    }
+
+    void test_quantize() {
+        if (quantize_kernel() == quantize_scalar_kernel()) {
+            std::cout << "quantize: no vector kernel on this cpu, skipped" << std::endl;
+            return;
+        }
+        std::mt19937 rng(5);
+        std::uniform_real_distribution<float> value(-.5f, 3.f);
+        const float specials[] = {std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::infinity(),
+                                  -std::numeric_limits<float>::infinity(), 1.f, 0.f, -0.f};
+        const int n = 100003; // not a multiple of eight, so the tail is covered too
+        std::vector<Vec3f> pixels(n);
+        for (Vec3f &c : pixels) {
+            for (int j = 0; j < 3; ++j) {
+                const unsigned r = rng() % 64;
+                c[j] = r < 6 ? specials[r] : value(rng);
+            }
+        }
+        std::vector<uint8_t> vector(3 * n), scalar(3 * n);
+        quantize_kernel()(pixels.data(), n, vector.data());
+        quantize_scalar_kernel()(pixels.data(), n, scalar.data());
+        int diff = 0;
+        for (int i = 0; i < 3 * n; ++i)
+            diff += vector[i] != scalar[i];
+        check(diff == 0, "quantize: " + std::to_string(diff) + " channels of " + quantize_kernel_name() +
+                         " differ from scalar");
+    }
+}
+
+int main() {
+    test_bvh("sweep bvh", BVHOptions(BVHBuilder::SweepSAH));
+    test_bvh("binned bvh", BVHOptions(BVHBuilder::BinnedSAH));
+    test_bvh("linear bvh", BVHOptions(BVHBuilder::Linear));
+    test_bvh("spatial bvh", BVHOptions(BVHBuilder::SpatialSAH));
+    test_bvh("bvh8", BVHOptions(BVHBuilder::BinnedSAH, true));
+    test_bvh("spatial bvh8", BVHOptions(BVHBuilder::SpatialSAH, true));
+    test_refit("refit bvh", BVHOptions(BVHBuilder::BinnedSAH));
+    test_refit("refit spatial bvh8", BVHOptions(BVHBuilder::SpatialSAH, true));
+    test_cache();
+    test_mesh_file();
+    test_instances();
+    test_spheres(10);
+    test_spheres(1000);
+    test_materials();
+    test_parse_obj();
+    test_quantize();
+    if (failures)
+        std::cerr << failures << " checks failed" << std::endl;
+    return failures ? 1 : 0;
+}